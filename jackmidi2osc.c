@@ -18,6 +18,10 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // sendmmsg
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #include <pthread.h>
@@ -26,20 +30,35 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <assert.h>
+#include <errno.h>
 
 #ifndef WIN32
 #include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <pthread.h>
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include <jack/jack.h>
 #include <jack/transport.h>
 #include <jack/ringbuffer.h>
@@ -51,6 +70,18 @@
 #define RINGBUF_SIZE 64
 #endif
 
+#ifndef MAX_SYSEX_SIZE
+#define MAX_SYSEX_SIZE 1024
+#endif
+
+#ifndef SYSEX_SLOTS
+#define SYSEX_SLOTS 32
+#endif
+
+#ifndef MAX_SYSEX_FILTER
+#define MAX_SYSEX_FILTER 16
+#endif
+
 #ifndef PATH_MAX
 #define PATH_MAX 1024
 #endif
@@ -64,701 +95,5549 @@
 #endif
 
 
+#ifndef MAX_PORTS
+#define MAX_PORTS 256 // MidiMessage.port is 8 bit
+#endif
+
+/* JackPortIsMIDI2 (jack2 >= 1.9.23, PipeWire): events of MIDI ports
+ * with this flag are Universal MIDI Packets */
+#ifndef PORT_IS_MIDI2
+#define PORT_IS_MIDI2 0x20
+#endif
+
 /* jack connection */
 jack_client_t *j_client = NULL;
-jack_port_t   *j_input_port;
+
+typedef struct {
+	char              *name;
+	char              *connect; // auto-connect at start
+	jack_port_t       *port;
+	/* process-callback state, events of all ports are merged in time order */
+	void              *buf;
+	uint32_t           count;
+	uint32_t           pos;
+	jack_midi_event_t  next;
+} InputPort;
+
+static InputPort    *ports = NULL;
+static unsigned int  port_count = 0;
 
 /* threaded communication */
 static jack_ringbuffer_t *rb = NULL;
-static pthread_mutex_t msg_thread_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
+
+/* OSC to MIDI feedback: OSC server thread -> process-callback (SPSC) */
+static jack_port_t       *out_port = NULL;
+static jack_ringbuffer_t *fb_rb = NULL;
+
+typedef struct {
+	uint8_t len;
+	uint8_t d[3];
+} FeedbackEvent;
+typedef struct {
+#ifdef _WIN32
+	HANDLE sem;
+#else
+	int    fd[2]; // read, write end
+#endif
+} Wakeup;
+
+#ifdef _WIN32
+static Wakeup main_wakeup = { NULL };
+#else
+static Wakeup main_wakeup = { { -1, -1 } };
+#endif
+
+/* statistics counters that are written by one thread and read by
+ * another one (process-callback, sender and OSC server threads).
+ * Relaxed atomics: no ordering is implied, and with a single writer
+ * a load and store suffices, rather than a read-modify-write. */
+#define STAT_GET(x)    __atomic_load_n (&(x), __ATOMIC_RELAXED)
+#define STAT_SET(x, v) __atomic_store_n (&(x), (v), __ATOMIC_RELAXED)
+#define STAT_ADD(x, n) STAT_SET (x, STAT_GET (x) + (n))
+#define STAT_INC(x)    STAT_ADD (x, 1)
 
 /* application state */
 
 static volatile enum {Terminate, Starting, Running} run = Starting;
 static int dropped_messages = 0;
+static int coalesced_messages = 0;
+static unsigned long sysex_oversize = 0;   // SysEx longer than MAX_SYSEX_SIZE
+static unsigned int  queue_hwm = 0;        // high-water mark (events)
+static unsigned long overflow_cycles = 0;  // cycles that dropped events
+static unsigned int  overflow_max = 0;     // max. events dropped in one cycle
+static unsigned long late_events = 0;
+static jack_nframes_t late_max = 0;
+static unsigned long tx_messages = 0;
+static unsigned long tx_packets = 0;
 static double samplerate = 48000.0;
 
 /* parameters & options */
 static char *j_connect     = NULL;
 static char *cfgfile       = NULL; // use default /etc/... ?
-static lo_address osc_dest = NULL;
+static int   ump_input     = 0;    // ports receive Universal MIDI Packets
+static char *usercfgfile   = NULL; // default.cfg, if found (for reload)
+static char *listen_url    = NULL; // OSC feedback server, port or URL
+static char *out_connect   = NULL; // auto-connect the MIDI output port
+static char *replay_file   = NULL; // replay events from file instead of using JACK
+static int   replay_realtime = 0;  // replay with original timing, not at full speed
+static int   null_sink     = 0;    // discard OSC packets
+static int   force_liblo   = 0;    // send all packets via liblo
+static char *journal_file  = NULL; // capture received events
+static unsigned int journal_mb = 64; // journal size in MiB
+
+#ifndef TXQ_SIZE
+#define TXQ_SIZE 65536 // per destination, bytes
+#endif
+
+#ifndef FEEDBACK_QUEUE
+#define FEEDBACK_QUEUE 1024 // OSC to MIDI feedback, events
+#endif
+
+#ifndef MMSG_BATCH
+#define MMSG_BATCH 64 // max. packets per sendmmsg() call
+#endif
+
+#ifndef COALESCE_EVENTS
+#define COALESCE_EVENTS 8192 // per port and cycle, 'Coalesce' overflow policy
+#endif
+
+#ifndef RECONNECT_MAX_MS
+#define RECONNECT_MAX_MS 5000 // max. backoff for stream transports
+#endif
+
+#ifndef STREAM_TIMEOUT_MS
+#define STREAM_TIMEOUT_MS 2000 // connect and send timeout for stream transports
+#endif
+
+#ifndef MAX_DESTS
+#define MAX_DESTS 32 // OSCMessageTemplate.dest is a bitmask
+#endif
+
+/* OSC destinations, index 0 is the default (osc=, -o) */
+typedef struct {
+	char        *name;
+	lo_address   addr;
+	int          proto;     // LO_UDP, LO_TCP, LO_UNIX
+	int          slip;      // stream framing: SLIP or OSC 1.0 length-prefix
+	int          raw;       // sent via own socket (not liblo)
+	int          fd;
+	struct sockaddr_storage sa;
+	socklen_t    salen;
+	/* OSC bundle being assembled */
+	uint8_t     *bundle;
+	unsigned int bundle_len;
+	unsigned int bundle_count;
+	unsigned int sub_off;   // offset of open timed sub-bundle
+	unsigned int sub_count;
+	/* packet queue to sender thread */
+	jack_ringbuffer_t *txq;
+	Wakeup       txq_wakeup;
+#ifndef WIN32
+	pthread_t    thread;
+#endif
+	int          thread_running;
+	volatile int thread_exit;
+	uint8_t     *txbuf;     // sender thread
+	uint8_t     *stream;    // framed stream data (TCP, Unix)
+#ifndef WIN32
+	struct iovec iov[MMSG_BATCH];
+#endif
+#ifdef __linux__
+	struct mmsghdr mmsg[MMSG_BATCH];
+#endif
+	/* statistics */
+	unsigned long messages;  // OSC messages queued by the main thread
+	unsigned int  txq_hwm;  // bytes
+	unsigned long txq_dropped;
+	unsigned long errors;
+	unsigned long alloc_sends; // sends that needed heap allocation
+	unsigned long syscalls;
+	unsigned long sent;      // packets passed to the kernel
+	unsigned long reconnects;
+	unsigned long untimed;   // Timetag sync-mode, messages too large for a bundle
+	uint32_t      wait_max;  // longest time a packet was queued (usec)
+	uint32_t      stall_max; // longest send call (usec)
+} OSCDest;
+
+/* queued packet */
+typedef struct {
+	uint32_t len;
+	uint32_t usec; // enqueue time (clock_usec, lower 32bit)
+} TxRecord;
+
+static OSCDest     *dests = NULL;
+static unsigned int dest_count = 0;
+static lo_timetag   tx_timetag = { 0, 1 };
+
+/* offset of JACK's microsecond clock to NTP time */
+static int64_t jack_ntp_offset = 0;
+
 static int want_verbose    = 0;
-static enum {SyncImmediate, SyncRelative, SyncAbsolute} sync_mode = SyncImmediate;
+static int want_latency    = 0;
+static int want_compile    = 0;
+static enum {SyncImmediate, SyncRelative, SyncAbsolute, SyncTimetag} sync_mode = SyncImmediate;
+static enum {BundleOff, BundleCycle, BundleRule} bundle_mode = BundleOff;
+static unsigned int osc_mtu = 1400;
+static unsigned int queue_size = RINGBUF_SIZE; // events
+static unsigned int queue_ms = 0;              // if set, queue_size is computed from samplerate
+static enum {DropNewest, DropOldest, DropCoalesce} overflow_policy = DropNewest;
+static unsigned int coalesce_ms = 0;           // 0: coalesce events of one cycle
+static jack_nframes_t coalesce_frames = 0;
+
+/* latency measurement, HDR-style histogram in microseconds:
+ * values are kept in HIST_SUB linear buckets per power of two
+ */
+#define HIST_SUB     8
+#define HIST_BUCKETS (30 * HIST_SUB)
+
+typedef struct {
+	unsigned long bucket[HIST_BUCKETS];
+	unsigned long count;
+	uint64_t      sum;
+	uint32_t      max;
+} Histogram;
+
+static Histogram     latency_dequeue; // process-callback to dequeue
+static Histogram     latency_send;    // dequeue to send
+static uint32_t     *latency_pending = NULL; // events waiting for bundle flush
+static unsigned int  latency_pending_count = 0;
+
+/* statistics: JSON dump on SIGUSR1 and/or periodically */
+static char         *stats_file = NULL;    // NULL: stdout
+static unsigned int  stats_interval = 0;   // seconds, 0: off
+static volatile int  stats_request = 0;
+static unsigned long rx_events = 0;        // events read from the queue
 
 /* MIDI to OSC map / rules */
+
+/* value of a placeholder: MIDI byte, rule state, 14bit value,
+ * full resolution value or UMP group */
+enum {ParamByte = 0, ParamState, ParamWide, ParamFull, ParamGroup};
+
+/* pre-compiled OSC parameter.
+ * constants are parsed once, placeholders are resolved to a
+ * MIDI byte selector (index + mask) and a linear map:
+ *   val = clamp (d[byte] & mask, src) -> tgt
+ */
+typedef struct {
+	unsigned int tpl;    // original template, offset in RuleSet.arena
+	uint8_t   is_const;
+	uint8_t   source;    // ParamByte, ParamState, ..
+	uint8_t   mapped;    // 0: pass-through value
+	uint16_t  byte;      // MIDI byte index (blob: first byte)
+	uint16_t  end;       // blob: last byte (inclusive)
+	uint8_t   mask;      // applied to MIDI byte
+	unsigned int offset; // byte-offset of the argument in the OSC packet
+	int       src[2];    // source range
+	int32_t   itgt[2];   // target range (int32)
+	float     ftgt[2];   // target range (float)
+	float     fscale;    // (ftgt[1] - ftgt[0]) / (src[1] - src[0])
+	int32_t   ival;      // constant value (int32)
+	float     fval;      // constant value (float)
+} OSCParam;
+
+/* templates and their parameters are kept in flat arrays of the
+ * rule-set, strings are interned in its arena. Elements refer to
+ * each other by index or offset.
+ */
 typedef struct {
-	char      path[1024];
+	unsigned int path;   // offset in RuleSet.arena
 	char      desc[16];
-	char    **param;
+	unsigned int param;  // index of the first parameter in RuleSet.params
+	unsigned int param_count;
+	unsigned int pkt;    // pre-serialized OSC message, offset in RuleSet.pkts, arguments are patched in place
+	unsigned int pkt_len;
+	unsigned int pkt_size; // allocated
+	unsigned int var_from; // index of first blob parameter, arguments from here on are re-serialized
+	uint32_t  dest;      // bitmask of destinations
 } OSCMessageTemplate;
 
+/* rule state, kept per MIDI channel and key/controller */
+enum {StateNone = 0, StateToggle, StateCounter, StateLast};
+
+#define STATE_SLOTS (16 * 128)
+
+/* the part of a rule that is checked for every candidate event,
+ * kept in a separate array (8 bytes per rule) */
 typedef struct {
 	uint8_t             mask[3];
 	uint8_t             match[3];
 	uint8_t             len;
+	int8_t              group;    // UMP group, -1: any
+} RuleFilter;
+
+typedef struct {
+	uint8_t             coalesce; // only fire for the latest value in a batch
+	uint8_t             port;     // index in ports[]
+	uint8_t             sysex_len; // SysEx rule: number of prefix bytes to match
+	uint8_t             state;     // StateNone, StateToggle, ..
+	unsigned int        sysex;     // offset of mask[sysex_len], match[sysex_len] in RuleSet.arena
+	int32_t             state_min; // value range of the state
+	int32_t             state_max;
+	unsigned int        state_off; // offset of the rule's slots in RuleSet.state
+	unsigned int        msg;       // index of the first template in RuleSet.msgs
 	unsigned int        message_count;
-	OSCMessageTemplate *msg;
+	unsigned long       hits;      // statistics
 } Rule;
 
-Rule *rules = NULL;
-unsigned int rule_count = 0;
+/* rule dispatch index, built once the config is loaded.
+ * For every status-byte the candidate rules are kept in config order:
+ * rules that do not filter on the first data-byte are in `wild`,
+ * rules that do, are listed per data-byte value in `data1`.
+ */
+typedef struct {
+	unsigned int off;   // offset into RuleSet.index_list
+	unsigned int count;
+} RuleBucket;
+
+typedef struct {
+	RuleBucket  wild;
+	RuleBucket *data1;  // [256], NULL if no candidate filters data-byte 1
+} StatusBucket;
+
+/* complete set of rules with its dispatch index.
+ * The active set is only accessed by the main thread. On SIGHUP the
+ * config is parsed into a new set by a helper thread, which the main
+ * thread swaps in between two batches of events.
+ */
+typedef struct {
+	RuleFilter   *filter;       // [rule_count]
+	Rule         *rules;        // [rule_count]
+	unsigned int  rule_count;
+	unsigned int  coalesce_rules;
+	unsigned int  decoded_rules; // rules matching CC14, NRPN or RPN
+	OSCMessageTemplate *msgs;   // templates of all rules, in rule order
+	unsigned int  msg_count;
+	OSCParam     *params;       // parameters of all templates
+	unsigned int  param_count;
+	uint8_t      *pkts;         // pre-serialized OSC messages
+	unsigned int  pkts_size;
+	char         *arena;        // interned paths and parameters, SysEx filters
+	unsigned int  arena_size;
+	StatusBucket (*index)[256]; // per port
+	unsigned int *index_list;
+	unsigned int  index_size;
+	int32_t      *state;        // STATE_SLOTS per stateful rule
+	unsigned int  state_size;
+	/* parser: capacity of the arrays above, string hash table */
+	unsigned int  rules_alloc;
+	unsigned int  msgs_alloc;
+	unsigned int  params_alloc;
+	unsigned int  pkts_alloc;
+	unsigned int  arena_alloc;
+	unsigned int *intern;       // arena offset + 1, 0: empty
+	unsigned int  intern_size;
+	unsigned int  intern_count;
+	void         *image;        // mapped rule cache, arrays and index point into it
+	size_t        image_size;
+} RuleSet;
+
+static RuleSet ruleset;
+
+/* OSC to MIDI feedback rule.
+ * Every MIDI byte is a constant `base`, optionally plus the value
+ * of an OSC argument. Feedback rules are only read on startup.
+ */
+enum {FbConst = 0, FbArg, FbArgLSB, FbArgMSB};
+
+typedef struct {
+	uint8_t base;
+	uint8_t mode; // FbConst, FbArg, ..
+	uint8_t arg;  // index of the OSC argument
+} FeedbackByte;
+
+typedef struct {
+	char        *path;
+	char        *types;  // NULL: any
+	uint8_t      len;
+	FeedbackByte b[3];
+} FeedbackRule;
+
+static FeedbackRule    *feedback = NULL;
+static unsigned int     feedback_count = 0;
+static lo_server_thread fb_server = NULL;
+static unsigned long    fb_received = 0; // written by the OSC server thread
+static unsigned long    fb_dropped = 0;
+
+#ifndef WIN32
+static pthread_t     reload_thread;
+static int           reload_running = 0;
+static volatile int  reload_request = 0; // set by SIGHUP
+static volatile int  reload_done = 0;    // set by reload thread
+static RuleSet      *reload_rules = NULL; // parsed rule-set, NULL on error
+
+static pthread_t     stats_thread;
+static int           stats_running = 0;
+static volatile int  stats_done = 0;     // set by stats thread
+#endif
 
-/* message passing */
+/* message passing.
+ * Messages longer than 3 bytes (SysEx) are followed by `len` bytes
+ * of payload (the complete message) in the queue.
+ */
 typedef struct {
 	jack_nframes_t tme;
-	uint8_t        d[3];
-	uint8_t        len;
+	uint32_t       usec;  // time of process-callback (jack_get_time, lower 32bit), dequeue time once read
+	uint32_t       value; // full resolution value, scaled to 32bit
+	uint16_t       len;   // message size in bytes
+	union {
+		uint16_t     sysex; // slot in sysex_pool (consumer side, len > 3)
+		uint16_t     group; // UMP group (len <= 3)
+	};
+	uint8_t        d[3];  // first three bytes
+	uint8_t        port;  // index in ports[]
 } MidiMessage;
 
-static int process_jmidi_event (jack_midi_event_t *ev, const jack_nframes_t tme) {
-	if (ev->size < 1 || ev->size > 3) {
-		return 0;
-	}
+/* event log: a header followed by queue records in host byte-order,
+ * MidiMessage and for messages longer than 3 bytes, `len` bytes payload.
+ * A record with len = 0 marks the end (unused space of a capture journal).
+ */
+#define EVLOG_MAGIC   "j2oevlog"
+#define EVLOG_VERSION 1
 
-	if (jack_ringbuffer_write_space (rb) >= sizeof (MidiMessage)) {
-		MidiMessage mmsg;
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t samplerate;
+} EventLogHeader;
 
-		mmsg.tme = tme + ev->time;
-		mmsg.d[0] = ev->buffer[0];
+/* events read from file, see replay_load() */
+typedef struct {
+	MidiMessage m;    // m.tme: replay position (frames)
+	uint8_t    *data; // complete message, if m.len > 3
+} ReplayEvent;
 
-		if (ev->size == 1) {
-			mmsg.len = 1;
-			mmsg.d[1] = 0;
-			mmsg.d[2] = 0;
-		} else if (ev->size == 2) {
-			mmsg.len = 2;
-			mmsg.d[1] = ev->buffer[1];
-			mmsg.d[2] = 0;
-		} else {
-			mmsg.len = 3;
-			mmsg.d[1] = ev->buffer[1];
-			mmsg.d[2] = ev->buffer[2];
-		}
+static ReplayEvent  *replay_events = NULL;
+static unsigned int  replay_count = 0;
 
-		jack_ringbuffer_write (rb, (void *) &mmsg, sizeof (MidiMessage));
-		return 1;
-	}
+/* capture journal, memory-mapped event log */
+#ifndef JOURNAL_SYNC
+#define JOURNAL_SYNC (1 << 20) // bytes
+#endif
 
-	++dropped_messages;
-	return 0;
-}
+static uint8_t      *journal = NULL;
+static size_t        journal_size = 0;
+static size_t        journal_pos = 0;
+static size_t        journal_synced = 0;
+static unsigned long journal_dropped = 0;
+#ifndef _WIN32
+static int           journal_fd = -1;
+#endif
 
-/* jack process callback */
-static int process (jack_nframes_t nframes, void *arg) {
-	if (run != Running) return 0;
+/* decoded messages, assembled from CC sequences by the main thread,
+ * or MIDI 2.0 messages without MIDI 1.0 equivalent.
+ * They use status bytes below 0x80 (channel in the lower nibble),
+ * d[1], d[2] hold the controller or the (N)RPN parameter MSB, LSB
+ * (MIDI 2.0: bank, index), or the note and per-note controller index.
+ * The per-note controller index is 8 bit (0..255).
+ */
+#define STATUS_CC14 0x10
+#define STATUS_NRPN 0x20
+#define STATUS_RPN  0x30
+#define STATUS_PNRC 0x40 // registered per-note controller
+#define STATUS_PNAC 0x50 // assignable per-note controller
+#define STATUS_PNPB 0x60 // per-note pitch-bend
+
+/* rule filter matches only MIDI 2.0 per-note controllers, d[2] is 8 bit */
+static inline int filter_is_pernote_cc (const uint8_t mask, const uint8_t match) {
+	return (mask & 0xf0) == 0xf0 && ((match & 0xf0) == STATUS_PNRC || (match & 0xf0) == STATUS_PNAC);
+}
 
-	const uint64_t frametime = jack_last_frame_time(j_client) + ((sync_mode == SyncRelative) ? nframes : 0);
+/* per port and MIDI channel */
+typedef struct {
+	uint8_t cc_msb[32]; // last MSB of CC 0..31
+	uint8_t param[2];   // selected (N)RPN parameter MSB, LSB
+	uint8_t selected;   // 0, STATUS_NRPN or STATUS_RPN
+	uint8_t data_msb;   // data entry MSB (CC 6)
+} DecoderState;
 
-	int n;
-	int wakeup = 0;
-	void *in_buf = jack_port_get_buffer (j_input_port, nframes);
-	int nevents = jack_midi_get_event_count (in_buf);
+static DecoderState *decoder = NULL;
 
-	for (n = 0; n < nevents; ++n) {
-		jack_midi_event_t ev;
-		jack_midi_event_get (&ev, in_buf, n);
-		wakeup |= process_jmidi_event (&ev, frametime);
-	}
+/* scheduled events (Absolute and Relative sync-mode) */
+typedef struct {
+	MidiMessage m;
+	uint32_t    seq;
+} SchedEvent;
+
+static SchedEvent  *sched = NULL;
+static unsigned int sched_len = 0;
+static unsigned int sched_size = 0;
+static uint32_t     sched_seq = 0;
+
+/* SysEx payload storage (consumer side) */
+static uint8_t      *sysex_pool = NULL;
+static uint16_t     *sysex_free = NULL;
+static unsigned int  sysex_free_count = 0;
+static unsigned long sysex_dropped = 0;
+
+/* events ready to be dispatched */
+static MidiMessage   *batch = NULL;
+static uint8_t       *batch_superseded = NULL;
+static unsigned int   batch_len = 0;
+static unsigned int   batch_size = 0;
+static jack_nframes_t batch_start = 0;
+static uint8_t       *coalesce_seen = NULL; // 256 * 128 bits per port
+
+/* 'Coalesce' overflow policy (process-callback) */
+static uint8_t       *overflow_seen = NULL;       // [16 groups *] 256 * 128 bits
+static uint8_t       *overflow_superseded = NULL; // COALESCE_EVENTS bits per port
 
-	// notify main thread
-	if (wakeup) {
-		if (pthread_mutex_trylock (&msg_thread_lock) == 0) {
-			pthread_cond_signal (&data_ready);
-			pthread_mutex_unlock (&msg_thread_lock);
-		}
-	}
+/******************************************************************************
+ * Clock
+ *
+ * The main thread uses JACK's frame-time and microsecond clock.
+ * When replaying events from a file, JACK is not used: frame-time is the
+ * replay position and the system's monotonic clock is used instead.
+ */
 
-	return 0;
-}
+static jack_nframes_t replay_frames = 0; // replay position
+static jack_time_t    replay_epoch  = 0; // clock at replay position 0
 
-/* callback if jack server terminates */
-static void jack_shutdown (void *arg) {
-	j_client=NULL;
-	pthread_cond_signal (&data_ready);
-	fprintf (stderr, "jack server shutdown\n");
+static uint64_t monotonic_nsec (void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency (&freq);
+	QueryPerformanceCounter (&cnt);
+	return (uint64_t)(cnt.QuadPart / (double)freq.QuadPart * 1e9);
+#else
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
-/* cleanup and exit */
-static void cleanup (void) {
-	int i;
-	if (j_client) {
-		jack_deactivate (j_client);
-		jack_client_close (j_client);
-	}
-	if (rb) {
-		jack_ringbuffer_free (rb);
+static inline jack_time_t clock_usec (void) {
+	if (replay_file) {
+		return monotonic_nsec () / 1000;
 	}
+	return jack_get_time ();
+}
 
-	for (i = 0; i < rule_count; ++i) {
-		int j;
-		const unsigned int mc = rules[i].message_count;
-		for (j = 0; j < mc; ++j) {
-			int k;
-			const unsigned int pl = strlen (rules[i].msg[j].desc);
-			for (k = 0; k < pl; ++k) {
-				free(rules[i].msg[j].param[k]);
-			}
-			free (rules[i].msg[j].param);
-		}
-		free (rules[i].msg);
+static inline jack_nframes_t frame_time (void) {
+	if (replay_file) {
+		return replay_frames;
 	}
+	return jack_frame_time (j_client);
+}
 
-	if (osc_dest) {
-		lo_address_free (osc_dest);
+static inline jack_time_t frames_to_usec (const jack_nframes_t tme) {
+	if (replay_file) {
+		return replay_epoch + tme * 1e6 / samplerate;
 	}
+	return jack_frames_to_time (j_client, tme);
+}
 
-	free(rules);
-	free(cfgfile);
-	free (j_connect);
+/******************************************************************************
+ * Thread wakeup
+ *
+ * The process-callback notifies the main thread, and the main thread
+ * notifies sender threads without taking a lock.
+ * Wakeups are never lost: pending notifications are kept by the kernel
+ * (eventfd counter, pipe or semaphore) until the thread waits.
+ */
 
-	rules = NULL;
-	cfgfile = NULL;
-	j_client = NULL;
-	j_connect = NULL;
-	osc_dest = NULL;
+static int wakeup_init (Wakeup *w) {
+#if defined _WIN32
+	w->sem = CreateSemaphore (NULL, 0, 1, NULL);
+	return w->sem ? 0 : -1;
+#elif defined __linux__
+	w->fd[0] = w->fd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return w->fd[0] >= 0 ? 0 : -1;
+#else
+	if (pipe (w->fd)) {
+		w->fd[0] = w->fd[1] = -1;
+		return -1;
+	}
+	fcntl (w->fd[0], F_SETFL, O_NONBLOCK);
+	fcntl (w->fd[1], F_SETFL, O_NONBLOCK);
+	return 0;
+#endif
 }
 
-/* open a client connection to the JACK server */
-static int init_jack (const char *client_name) {
-	jack_status_t status;
-	j_client = jack_client_open (client_name, JackNullOption, &status);
-	if (j_client == NULL) {
-		fprintf (stderr, "jack_client_open () failed, status = 0x%2.0x\n", status);
-		if (status & JackServerFailed) {
-			fprintf (stderr, "Unable to connect to JACK server\n");
-		}
-		return (-1);
+static void wakeup_close (Wakeup *w) {
+#if defined _WIN32
+	if (w->sem) {
+		CloseHandle (w->sem);
 	}
-	if (status & JackServerStarted) {
-		fprintf (stderr, "JACK server started\n");
+	w->sem = NULL;
+#else
+	if (w->fd[0] >= 0) {
+		close (w->fd[0]);
 	}
-	if (status & JackNameNotUnique) {
-		client_name = jack_get_client_name (j_client);
-		fprintf (stderr, "jack-client name: `%s'\n", client_name);
+	if (w->fd[1] >= 0 && w->fd[1] != w->fd[0]) {
+		close (w->fd[1]);
 	}
-	jack_set_process_callback (j_client, process, 0);
-	samplerate = (double) jack_get_sample_rate (j_client);
+	w->fd[0] = w->fd[1] = -1;
+#endif
+}
 
-	jack_on_shutdown (j_client, jack_shutdown, NULL);
-	return (0);
+/* realtime-safe, may also be called from a signal-handler */
+static inline void wakeup_signal (Wakeup *w) {
+#if defined _WIN32
+	ReleaseSemaphore (w->sem, 1, NULL);
+#elif defined __linux__
+	const uint64_t one = 1;
+	if (write (w->fd[1], &one, sizeof (one)) != sizeof (one)) {
+		; // counter overflow: a wakeup is pending anyway
+	}
+#else
+	const char c = 0;
+	if (write (w->fd[1], &c, 1) != 1) {
+		; // pipe is full: a wakeup is pending anyway
+	}
+#endif
 }
 
-static int jack_portsetup (void) {
-	if ((j_input_port = jack_port_register (j_client, "in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
-		fprintf (stderr, "cannot register MIDI input port !\n");
-		return (-1);
+/* wait for a wakeup, or until timeout (microseconds, < 0: no timeout) */
+static void wakeup_wait (Wakeup *w, const int64_t timeout_us) {
+#if defined _WIN32
+	WaitForSingleObject (w->sem, timeout_us < 0 ? INFINITE : (DWORD)((timeout_us + 999) / 1000));
+#else
+	fd_set fds;
+	struct timeval tv;
+	FD_ZERO (&fds);
+	FD_SET (w->fd[0], &fds);
+	tv.tv_sec  = timeout_us / 1000000;
+	tv.tv_usec = timeout_us % 1000000;
+	if (select (w->fd[0] + 1, &fds, NULL, NULL, timeout_us < 0 ? NULL : &tv) > 0) {
+		char buf[64];
+		while (read (w->fd[0], buf, sizeof (buf)) > 0) ;
 	}
-	return (0);
+#endif
 }
 
-static int inport_connect (char *port) {
-	if (port && strlen(port) < 1) {
-		return 0;
+/* MIDI 2.0 min-center-max scaling of a `bits` wide value to 32bit */
+static uint32_t scale_up (const uint32_t val, const unsigned int bits) {
+	const unsigned int scale_bits  = 32 - bits;
+	const unsigned int repeat_bits = bits - 1;
+	uint32_t rv = val << scale_bits;
+	if (val <= (1u << repeat_bits)) {
+		return rv;
 	}
-	if (port && jack_connect (j_client, port, jack_port_name (j_input_port))) {
-		fprintf (stderr, "cannot connect port %s to %s\n", port, jack_port_name (j_input_port));
-		return 1;
+	uint32_t repeat = val & ((1u << repeat_bits) - 1);
+	if (scale_bits > repeat_bits) {
+		repeat <<= scale_bits - repeat_bits;
+	} else {
+		repeat >>= repeat_bits - scale_bits;
 	}
-	return 0;
+	while (repeat != 0) {
+		rv |= repeat;
+		repeat >>= repeat_bits;
+	}
+	return rv;
 }
 
-
-/******************************************************************************
- * Configuration & Rules
- */
-
-#ifdef _WIN32
-static char * strndup (const char *s, size_t n) {
-	size_t len = strlen (s);
-
-	if (n < len) {
-		len = n;
+/* value of a MIDI 1.0 message: last data byte, or 14bit pitch-bend, song-position */
+static inline uint32_t midi1_value (const uint8_t *d, const unsigned int len) {
+	if (len == 3 && ((d[0] & 0xf0) == 0xe0 || d[0] == 0xf2)) {
+		return scale_up (((d[2] & 0x7f) << 7) | (d[1] & 0x7f), 14);
 	}
+	if (len == 2 || len == 3) {
+		return scale_up (d[len - 1] & 0x7f, 7);
+	}
+	return 0;
+}
 
-	char *rv = (char *) malloc (len + 1);
-	if (!rv) {
+/* Universal MIDI Packet to message, MIDI 1.0 fields are set to
+ * the MIDI 1.0 equivalent, `value` retains the full resolution.
+ * Returns 0 for unsupported packets (utility, SysEx, data).
+ */
+static int ump_to_midi (const jack_midi_event_t *ev, MidiMessage *m) {
+	uint32_t w[2];
+	if (ev->size < 4 || (ev->size & 3)) {
 		return 0;
 	}
+	memcpy (&w[0], ev->buffer, 4);
+
+	m->group = (w[0] >> 24) & 0x0f;
+	m->d[0]  = (w[0] >> 16) & 0xff;
+	m->d[1]  = (w[0] >> 8) & 0x7f;
+	m->d[2]  = w[0] & 0x7f;
+
+	switch (w[0] >> 28) {
+		case 0x1: // system common and real-time
+			m->len = m->d[0] == 0xf2 ? 3 : (m->d[0] == 0xf1 || m->d[0] == 0xf3) ? 2 : 1;
+			m->value = midi1_value (m->d, m->len);
+			return m->d[0] > 0xf0;
+		case 0x2: // MIDI 1.0 channel voice
+			if (m->d[0] < 0x80) {
+				return 0;
+			}
+			m->len = (m->d[0] & 0xe0) == 0xc0 ? 2 : 3;
+			m->value = midi1_value (m->d, m->len);
+			return 1;
+		case 0x4: // MIDI 2.0 channel voice
+			if (ev->size < 8) {
+				return 0;
+			}
+			break;
+		default:
+			return 0;
+	}
 
-	rv[len] = '\0';
-	return memcpy (rv, s, len);
+	memcpy (&w[1], ev->buffer + 4, 4);
+	const uint8_t chn = m->d[0] & 0x0f;
+	m->len = 3;
+	m->value = w[1];
+
+	switch (m->d[0] & 0xf0) {
+		case 0x80:
+		case 0x90:
+			m->value = scale_up (w[1] >> 16, 16);
+			m->d[2] = w[1] >> 25;
+			if (m->d[0] >= 0x90 && m->d[2] == 0) {
+				m->d[2] = 1; // a MIDI 2.0 note-on is never a note-off
+			}
+			break;
+		case 0xa0:
+		case 0xb0:
+			m->d[2] = w[1] >> 25;
+			break;
+		case 0xc0:
+			m->len = 2;
+			m->d[1] = (w[1] >> 24) & 0x7f;
+			m->d[2] = 0;
+			m->value = scale_up (m->d[1], 7);
+			break;
+		case 0xd0:
+			m->len = 2;
+			m->d[1] = w[1] >> 25;
+			m->d[2] = 0;
+			break;
+		case 0xe0:
+			m->d[1] = (w[1] >> 18) & 0x7f;
+			m->d[2] = w[1] >> 25;
+			break;
+		case 0x00:
+			m->d[0] = STATUS_PNRC | chn;
+			m->d[2] = w[0] & 0xff;
+			break;
+		case 0x10:
+			m->d[0] = STATUS_PNAC | chn;
+			m->d[2] = w[0] & 0xff;
+			break;
+		case 0x20:
+			m->d[0] = STATUS_RPN | chn;
+			break;
+		case 0x30:
+			m->d[0] = STATUS_NRPN | chn;
+			break;
+		case 0x60:
+			m->d[0] = STATUS_PNPB | chn;
+			m->d[2] = 0;
+			break;
+		default:
+			return 0; // relative (N)RPN, per-note management
+	}
+	return 1;
 }
-#endif
-
-static int append_osc_message (Rule *r, const char *path, const char *desc, const char *param) {
-	assert (path);
-	assert (desc);
-	assert (param);
 
-	const unsigned int mi = r->message_count;
-	r->msg = realloc(r->msg, (++r->message_count) * sizeof(OSCMessageTemplate));
-	if (!r->msg) {
-		r->message_count = 0;
-		fprintf (stderr, "Failed to allocate memory for message\n");
-		return -1;
+static inline size_t queue_record_size (const jack_midi_event_t *ev) {
+	if (ump_input) {
+		return sizeof (MidiMessage);
 	}
+	return sizeof (MidiMessage) + (ev->size > 3 ? ev->size : 0);
+}
 
-	strncpy(r->msg[mi].path, path,   sizeof(r->msg[mi].path));
-	strncpy(r->msg[mi].desc, desc,   sizeof(r->msg[mi].desc));
-	r->msg[mi].param = NULL;
+static inline int is_valid_event (const jack_midi_event_t *ev) {
+	if (ump_input) {
+		MidiMessage m;
+		return ump_to_midi (ev, &m);
+	}
+	return ev->size > 0 && ev->size <= MAX_SYSEX_SIZE;
+}
 
-	const unsigned int pl = strlen(desc);
-	if (pl == 0) {
+static int process_jmidi_event (jack_midi_event_t *ev, const jack_nframes_t tme, const uint32_t usec, const unsigned int port) {
+	if (!is_valid_event (ev)) {
 		return 0;
 	}
 
-	const char *t0 = param;
-	r->msg[mi].param = (char**) calloc (pl, sizeof(char*));
+	const size_t rs = queue_record_size (ev);
 
-	unsigned int j;
-	for (j = 0; j < pl; ++j) {
-		assert (t0);
+	if (jack_ringbuffer_write_space (rb) >= rs) {
+		MidiMessage mmsg;
 
-		while (*t0 && *t0 != '"') { ++t0; }
-		if (!*t0) { break; }
-		assert (*t0 == '"');
-		++t0;
-		while (desc[j] != 's' && *t0 && *t0 == ' ') { ++t0; }
-		if (!*t0) { break; }
+		mmsg.tme = tme + ev->time;
+		mmsg.usec = usec;
+		mmsg.port = port;
 
-		const char *tmp = strchr(t0, '"'); // TODO ignore escaped quotes
+		if (ump_input) {
+			ump_to_midi (ev, &mmsg);
+			jack_ringbuffer_write (rb, (void *) &mmsg, sizeof (MidiMessage));
+			return 1;
+		}
 
-		if (!tmp) { break; }
+		mmsg.len = ev->size;
+		mmsg.sysex = 0;
+		mmsg.d[0] = ev->buffer[0];
+		mmsg.d[1] = ev->size > 1 ? ev->buffer[1] : 0;
+		mmsg.d[2] = ev->size > 2 ? ev->buffer[2] : 0;
+		mmsg.value = midi1_value (mmsg.d, ev->size);
 
-		if (tmp == t0) {
-			if (desc[j] != 's') break;
-			r->msg[mi].param[j] = strdup("");
-		} else {
-			r->msg[mi].param[j] = strndup(t0, tmp - t0);
+		if (ev->size <= 3) {
+			jack_ringbuffer_write (rb, (void *) &mmsg, sizeof (MidiMessage));
+			return 1;
 		}
-		t0 = ++tmp;
-	}
 
-	if (j != pl) {
-		fprintf (stderr, "Invalid Config, expected %d parameters, got %d.\n", pl, j + 1);
-		for (j = 0; j < pl; ++j) {
-			free(r->msg[mi].param[j]);
-		}
-		free(r->msg[mi].param);
-		--r->message_count;
-		return -1;
+		/* header and payload are published with a single write,
+		 * the reader never sees a header without its data */
+		static uint8_t record[sizeof (MidiMessage) + MAX_SYSEX_SIZE];
+		memcpy (record, &mmsg, sizeof (MidiMessage));
+		memcpy (record + sizeof (MidiMessage), ev->buffer, ev->size);
+		jack_ringbuffer_write (rb, (void *) record, rs);
+		return 1;
 	}
+
+	STAT_INC (dropped_messages);
 	return 0;
 }
 
-static Rule *new_rule (const char *flt) {
-	const unsigned int rc = rule_count;
-	rules = (Rule*) realloc(rules, (++rule_count) * sizeof(Rule));
-	if (!rules) {
-		fprintf (stderr, "Out of memory for rule(s).\n");
-		rule_count = 0;
+/* events that replace an earlier value: CC, pitch-bend, pressure */
+static inline int is_coalescable (const uint8_t status, const size_t len) {
+	switch (status & 0xf0) {
+		case 0xa0:
+		case 0xb0:
+			return len == 3;
+		case 0xd0:
+			return len == 2;
+		case 0xe0:
+			return len == 3;
+		default:
+			return 0;
+	}
+}
+
+/* group, status and key/controller (poly-pressure, CC) of a coalescable
+ * event. UMP are compared by their MIDI 1.0 equivalent message */
+static inline int overflow_key (const jack_midi_event_t *ev, uint32_t *key) {
+	const uint8_t *d = ev->buffer;
+	size_t len = ev->size;
+	uint32_t group = 0;
+	MidiMessage m;
+	if (ump_input) {
+		if (!ump_to_midi (ev, &m)) {
+			return 0;
+		}
+		d = m.d;
+		len = m.len;
+		group = m.group;
+	}
+	if (!is_coalescable (d[0], len)) {
+		return 0;
+	}
+	const int keyed = (d[0] & 0xe0) == 0xa0;
+	*key = (group << 15) | (d[0] << 7) | (keyed ? d[1] & 0x7f : 0);
+	return 1;
+}
+
+/* mark events of port `p` that are superseded by a later event with
+ * the same key in this cycle. One backwards pass sets the key of every
+ * event in `overflow_seen`, a second pass clears it again.
+ */
+static void coalesce_mark (const unsigned int p) {
+	InputPort *ip = &ports[p];
+	uint8_t *sup = &overflow_superseded[p * (COALESCE_EVENTS / 8)];
+	const uint32_t n = ip->count < COALESCE_EVENTS ? ip->count : COALESCE_EVENTS;
+	jack_midi_event_t ev;
+	uint32_t i, key;
+
+	memset (sup, 0, (n + 7) / 8);
+	for (i = ip->count; i > 0; --i) {
+		jack_midi_event_get (&ev, ip->buf, i - 1);
+		if (!overflow_key (&ev, &key)) {
+			continue;
+		}
+		if (!(overflow_seen[key >> 3] & (1 << (key & 7)))) {
+			overflow_seen[key >> 3] |= 1 << (key & 7);
+		} else if (i - 1 < n) {
+			sup[(i - 1) >> 3] |= 1 << ((i - 1) & 7);
+		}
+	}
+	for (i = 0; i < ip->count; ++i) {
+		jack_midi_event_get (&ev, ip->buf, i);
+		if (overflow_key (&ev, &key)) {
+			overflow_seen[key >> 3] = 0;
+		}
+	}
+}
+
+/* check if event `n` of port `p` is superseded by a later event in the
+ * same cycle, events beyond COALESCE_EVENTS are never superseded */
+static inline int is_superseded (const unsigned int p, const uint32_t n) {
+	if (n >= COALESCE_EVENTS) {
+		return 0;
+	}
+	return overflow_superseded[p * (COALESCE_EVENTS / 8) + (n >> 3)] & (1 << (n & 7));
+}
+
+/* rewind all input ports to the first event of the cycle */
+static void ports_rewind (void) {
+	unsigned int p;
+	for (p = 0; p < port_count; ++p) {
+		InputPort *ip = &ports[p];
+		ip->pos = 0;
+		if (ip->count > 0) {
+			jack_midi_event_get (&ip->next, ip->buf, 0);
+		}
+	}
+}
+
+/* next event of all ports in time order, ties go to the lower port index */
+static int ports_next (jack_midi_event_t *ev, unsigned int *port) {
+	unsigned int p;
+	InputPort *best = NULL;
+	for (p = 0; p < port_count; ++p) {
+		InputPort *ip = &ports[p];
+		if (ip->pos < ip->count && (!best || ip->next.time < best->next.time)) {
+			best = ip;
+			*port = p;
+		}
+	}
+	if (!best) {
+		return 0;
+	}
+	*ev = best->next;
+	if (++best->pos < best->count) {
+		jack_midi_event_get (&best->next, best->buf, best->pos);
+	}
+	return 1;
+}
+
+/* write pending feedback events to the MIDI output port */
+static void feedback_process (const jack_nframes_t nframes) {
+	FeedbackEvent fe;
+	void *buf = jack_port_get_buffer (out_port, nframes);
+	jack_midi_clear_buffer (buf);
+
+	if (run != Running) {
+		return;
+	}
+
+	while (jack_ringbuffer_read_space (fb_rb) >= sizeof (FeedbackEvent)) {
+		jack_ringbuffer_peek (fb_rb, (char*) &fe, sizeof (FeedbackEvent));
+		if (jack_midi_event_write (buf, 0, fe.d, fe.len)) {
+			break; // port-buffer is full, retry next cycle
+		}
+		jack_ringbuffer_read_advance (fb_rb, sizeof (FeedbackEvent));
+	}
+}
+
+/* jack process callback */
+static int process (jack_nframes_t nframes, void *arg) {
+	if (out_port) {
+		feedback_process (nframes);
+	}
+
+	if (run != Running) return 0;
+
+	const uint64_t frametime = jack_last_frame_time(j_client) + ((sync_mode == SyncRelative || sync_mode == SyncTimetag) ? nframes : 0);
+
+	unsigned int p;
+	unsigned int nevents = 0;
+	jack_midi_event_t ev;
+
+	for (p = 0; p < port_count; ++p) {
+		InputPort *ip = &ports[p];
+		ip->buf = jack_port_get_buffer (ip->port, nframes);
+		ip->count = jack_midi_get_event_count (ip->buf);
+		nevents += ip->count;
+	}
+
+	if (nevents == 0) {
+		return 0;
+	}
+
+	const uint32_t usec = jack_get_time ();
+	const size_t space = jack_ringbuffer_write_space (rb);
+	unsigned int skip_oldest = 0;
+	size_t coalesce = 0;
+
+	/* SysEx records carry their payload, only skip the exact
+	 * size check if the cycle fits even at the largest record size */
+	if (nevents * (sizeof (MidiMessage) + MAX_SYSEX_SIZE) > space && overflow_policy != DropNewest) {
+		/* queue overflow: apply backpressure policy */
+		size_t need = 0;
+		ports_rewind ();
+		while (ports_next (&ev, &p)) {
+			if (is_valid_event (&ev)) {
+				need += queue_record_size (&ev);
+			}
+		}
+		if (need > space) {
+			if (overflow_policy == DropOldest) {
+				ports_rewind ();
+				while (need > space && ports_next (&ev, &p)) {
+					if (is_valid_event (&ev)) {
+						need -= queue_record_size (&ev);
+						++skip_oldest;
+					}
+				}
+			} else if (overflow_policy == DropCoalesce) {
+				coalesce = need - space;
+				for (p = 0; p < port_count; ++p) {
+					coalesce_mark (p);
+				}
+			}
+		}
+	}
+
+	unsigned int valid = 0;
+	unsigned int written = 0;
+	ports_rewind ();
+	while (ports_next (&ev, &p)) {
+		if (!is_valid_event (&ev)) {
+			if (!ump_input && ev.size > MAX_SYSEX_SIZE) {
+				STAT_INC (sysex_oversize);
+			}
+			continue;
+		}
+		++valid;
+		if (skip_oldest > 0) {
+			--skip_oldest;
+			STAT_INC (dropped_messages);
+			continue;
+		}
+		if (coalesce > 0 && is_superseded (p, ports[p].pos - 1)) {
+			const size_t rs = queue_record_size (&ev);
+			coalesce = coalesce > rs ? coalesce - rs : 0;
+			STAT_INC (coalesced_messages);
+			continue;
+		}
+		if (process_jmidi_event (&ev, frametime, usec, p)) {
+			++written;
+		}
+	}
+
+	if (written < valid) {
+		STAT_INC (overflow_cycles);
+		if (valid - written > overflow_max) {
+			STAT_SET (overflow_max, valid - written);
+		}
+	}
+
+	const unsigned int used = jack_ringbuffer_read_space (rb) / sizeof (MidiMessage);
+	if (used > queue_hwm) {
+		STAT_SET (queue_hwm, used);
+	}
+
+	// notify main thread
+	if (written > 0) {
+		wakeup_signal (&main_wakeup);
+	}
+
+	return 0;
+}
+
+/* callback if jack server terminates */
+static void jack_shutdown (void *arg) {
+	j_client=NULL;
+	wakeup_signal (&main_wakeup);
+	fprintf (stderr, "jack server shutdown\n");
+}
+
+static void ruleset_free (RuleSet *rs) {
+	int i;
+	free (rs->state);
+	free (rs->intern);
+#ifndef _WIN32
+	if (rs->image) {
+		munmap (rs->image, rs->image_size);
+		memset (rs, 0, sizeof (RuleSet));
+		return;
+	}
+#endif
+	if (rs->index) {
+		for (i = 0; i < 256 * port_count; ++i) {
+			free (rs->index[i / 256][i % 256].data1);
+		}
+	}
+	free (rs->index);
+	free (rs->index_list);
+	free (rs->filter);
+	free (rs->rules);
+	free (rs->msgs);
+	free (rs->params);
+	free (rs->pkts);
+	free (rs->arena);
+	memset (rs, 0, sizeof (RuleSet));
+}
+
+/* cleanup and exit */
+static void cleanup (void) {
+	int i;
+	if (fb_server) {
+		lo_server_thread_free (fb_server);
+		fb_server = NULL;
+	}
+	if (j_client) {
+		jack_deactivate (j_client);
+		jack_client_close (j_client);
+	}
+	if (rb) {
+		jack_ringbuffer_free (rb);
+	}
+	if (fb_rb) {
+		jack_ringbuffer_free (fb_rb);
+	}
+
+#ifndef WIN32
+	if (reload_running) {
+		pthread_join (reload_thread, NULL);
+		reload_running = 0;
+	}
+	if (stats_running) {
+		pthread_join (stats_thread, NULL);
+		stats_running = 0;
+	}
+	if (reload_rules) {
+		ruleset_free (reload_rules);
+		free (reload_rules);
+		reload_rules = NULL;
+	}
+#endif
+	ruleset_free (&ruleset);
+
+	for (i = 0; i < dest_count; ++i) {
+#ifndef WIN32
+		if (dests[i].thread_running) {
+			dests[i].thread_exit = 1;
+			wakeup_signal (&dests[i].txq_wakeup);
+			pthread_join (dests[i].thread, NULL);
+		}
+#endif
+		if (dests[i].txq) {
+			wakeup_close (&dests[i].txq_wakeup);
+			jack_ringbuffer_free (dests[i].txq);
+		}
+		free (dests[i].txbuf);
+		free (dests[i].stream);
+		if (dests[i].addr) {
+			lo_address_free (dests[i].addr);
+		}
+#ifndef _WIN32
+		if (dests[i].fd >= 0) {
+			close (dests[i].fd);
+		}
+#endif
+		free (dests[i].bundle);
+		free (dests[i].name);
+	}
+	free (dests);
+
+	for (i = 0; i < port_count; ++i) {
+		free (ports[i].name);
+		free (ports[i].connect);
+	}
+	free (ports);
+
+	free(cfgfile);
+	free(usercfgfile);
+	free (j_connect);
+	free (stats_file);
+	free (listen_url);
+	free (out_connect);
+	free (replay_file);
+	free (journal_file);
+
+	for (i = 0; i < replay_count; ++i) {
+		free (replay_events[i].data);
+	}
+	free (replay_events);
+	replay_events = NULL;
+	replay_count = 0;
+
+	for (i = 0; i < feedback_count; ++i) {
+		free (feedback[i].path);
+		free (feedback[i].types);
+	}
+	free (feedback);
+	feedback = NULL;
+	feedback_count = 0;
+
+	ports = NULL;
+	port_count = 0;
+	cfgfile = NULL;
+	usercfgfile = NULL;
+	j_client = NULL;
+	j_connect = NULL;
+	listen_url = NULL;
+	out_connect = NULL;
+	replay_file = NULL;
+	journal_file = NULL;
+	out_port = NULL;
+	fb_rb = NULL;
+	free (sched);
+	free (batch);
+	free (batch_superseded);
+	free (latency_pending);
+	free (coalesce_seen);
+	free (overflow_seen);
+	free (overflow_superseded);
+	free (sysex_pool);
+	free (sysex_free);
+	free (decoder);
+	wakeup_close (&main_wakeup);
+
+	dests = NULL;
+	dest_count = 0;
+	sched = NULL;
+	batch = NULL;
+	batch_superseded = NULL;
+	latency_pending = NULL;
+	coalesce_seen = NULL;
+	overflow_seen = NULL;
+	overflow_superseded = NULL;
+	sysex_pool = NULL;
+	sysex_free = NULL;
+}
+
+/* open a client connection to the JACK server */
+static int init_jack (const char *client_name) {
+	jack_status_t status;
+	j_client = jack_client_open (client_name, JackNullOption, &status);
+	if (j_client == NULL) {
+		fprintf (stderr, "jack_client_open () failed, status = 0x%2.0x\n", status);
+		if (status & JackServerFailed) {
+			fprintf (stderr, "Unable to connect to JACK server\n");
+		}
+		return (-1);
+	}
+	if (status & JackServerStarted) {
+		fprintf (stderr, "JACK server started\n");
+	}
+	if (status & JackNameNotUnique) {
+		client_name = jack_get_client_name (j_client);
+		fprintf (stderr, "jack-client name: `%s'\n", client_name);
+	}
+	jack_set_process_callback (j_client, process, 0);
+	samplerate = (double) jack_get_sample_rate (j_client);
+
+	jack_on_shutdown (j_client, jack_shutdown, NULL);
+	return (0);
+}
+
+static int jack_portsetup (void) {
+	unsigned int p;
+	for (p = 0; p < port_count; ++p) {
+		if ((ports[p].port = jack_port_register (j_client, ports[p].name, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput | (ump_input ? PORT_IS_MIDI2 : 0), 0)) == 0) {
+			fprintf (stderr, "cannot register MIDI input port '%s'!\n", ports[p].name);
+			return (-1);
+		}
+	}
+	if (feedback_count > 0 && (out_port = jack_port_register (j_client, "out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
+		fprintf (stderr, "cannot register MIDI output port!\n");
+		return (-1);
+	}
+	return (0);
+}
+
+static int inport_connect (InputPort *ip, char *port) {
+	if (port && strlen(port) < 1) {
+		return 0;
+	}
+	if (port && jack_connect (j_client, port, jack_port_name (ip->port))) {
+		fprintf (stderr, "cannot connect port %s to %s\n", port, jack_port_name (ip->port));
+		return 1;
+	}
+	return 0;
+}
+
+/* lock memory, activate the client and auto-connect ports */
+static int jack_start (void) {
+	unsigned int i;
+#ifndef _WIN32
+	if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
+		fprintf (stderr, "Warning: Cannot lock memory.\n");
+	}
+#endif
+
+	if (jack_activate (j_client)) {
+		fprintf (stderr, "cannot activate client.\n");
+		return -1;
+	}
+
+	if (inport_connect (&ports[0], j_connect)) {
+		return -1;
+	}
+
+	for (i = 0; i < port_count; ++i) {
+		if (inport_connect (&ports[i], ports[i].connect)) {
+			return -1;
+		}
+	}
+
+	if (out_port && out_connect && strlen (out_connect) > 0 && jack_connect (j_client, jack_port_name (out_port), out_connect)) {
+		fprintf (stderr, "cannot connect port %s to %s\n", jack_port_name (out_port), out_connect);
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * Configuration & Rules
+ */
+
+#ifdef _WIN32
+static char * strndup (const char *s, size_t n) {
+	size_t len = strlen (s);
+
+	if (n < len) {
+		len = n;
+	}
+
+	char *rv = (char *) malloc (len + 1);
+	if (!rv) {
+		return 0;
+	}
+
+	rv[len] = '\0';
+	return memcpy (rv, s, len);
+}
+#endif
+
+/* blob: "%*" complete message, "%{a-b}" or "%{a-}" byte range */
+static int compile_blob (OSCParam *p, const char *tpl) {
+	unsigned int first, last;
+	const char *t;
+	char *end;
+
+	if (!strcmp (tpl, "%*")) {
+		p->byte = 0;
+		p->end  = MAX_SYSEX_SIZE - 1;
+		return 0;
+	}
+	if (strncmp (tpl, "%{", 2)) {
+		goto invalid;
+	}
+	first = strtoul (&tpl[2], &end, 0);
+	if (end == &tpl[2] || *end != '-') {
+		goto invalid;
+	}
+	t = end + 1;
+	if (*t == '}') {
+		last = MAX_SYSEX_SIZE - 1;
+	} else {
+		last = strtoul (t, &end, 0);
+		if (end == t || *end != '}') {
+			goto invalid;
+		}
+		t = end;
+	}
+	if (t[1] != '\0') {
+		goto invalid;
+	}
+	if (first > last || last >= MAX_SYSEX_SIZE) {
+		fprintf (stderr, "Invalid Byte range: %s\n", tpl);
+		return -1;
+	}
+	p->byte = first;
+	p->end  = last;
+	return 0;
+
+invalid:
+	fprintf (stderr, "Invalid Blob expression: %s\n", tpl);
+	return -1;
+}
+
+static int compile_param (OSCParam *p, const char *tpl, const char type, const Rule *r, const RuleFilter *f) {
+	switch (type) {
+		case LO_INT32:
+		case LO_FLOAT:
+			break;
+		case LO_STRING:
+			p->is_const = 1;
+			return 0;
+		case LO_BLOB:
+			return compile_blob (p, tpl);
+		default:
+			fprintf (stderr, "Unsupported OSC parameter type '%c'.\n", type);
+			return -1;
+	}
+
+	if (tpl[0] == '\0') {
+		fprintf (stderr, "Empty OSC parameter.\n");
+		return -1;
+	}
+
+	if (tpl[0] != '%') {
+		p->is_const = 1;
+		p->ival = atoi (tpl);
+		p->fval = atof (tpl);
+		return 0;
+	}
+
+	const char *expr = tpl + 2;
+	int n;
+	int smin = 0;
+	int smax;
+	float target[2];
+
+	switch (tpl[1]) {
+		case '0': p->byte = 0; p->mask = 0xff; smax = 0xff; break;
+		case '1': p->byte = 1; p->mask = 0x7f; smax = 0x7f; break;
+		case '2': p->byte = 2; p->mask = filter_is_pernote_cc (f->mask[0], f->match[0]) ? 0xff : 0x7f; smax = p->mask; break;
+		case 'c': p->byte = 0; p->mask = 0x0f; smax = 0x0f; break;
+		case 's': p->byte = 0; p->mask = 0xf0; smax = 0xff; break;
+		case '{':
+			{
+				/* byte at given offset, e.g. SysEx data */
+				char *end;
+				const long b = strtol (&tpl[2], &end, 0);
+				if (end == &tpl[2] || *end != '}' || b < 0 || b >= MAX_SYSEX_SIZE) {
+					fprintf (stderr, "Invalid Placeholder: %s\n", tpl);
+					return -1;
+				}
+				p->byte = b;
+				p->mask = b == 0 ? 0xff : 0x7f;
+				smax = p->mask;
+				expr = end + 1;
+			}
+			break;
+		case 'v':
+			if (r->state == StateNone) {
+				fprintf (stderr, "Placeholder requires a rule state: %s\n", tpl);
+				return -1;
+			}
+			p->source = ParamState;
+			smin = r->state_min;
+			smax = r->state_max;
+			break;
+		case 'w':
+			/* pitch-bend or decoded CC14, NRPN, RPN */
+			p->source = ParamWide;
+			smax = 0x3fff;
+			break;
+		case 'g':
+			p->source = ParamGroup;
+			smax = 0x0f;
+			break;
+		case 'u':
+			/* full resolution: 0..1 (float), 0..2^31-1 (int),
+			 * only a target-range can be given */
+			p->source = ParamFull;
+			if (*expr == '\0') {
+				p->mapped = 0;
+				return 0;
+			}
+			if (2 != sscanf(expr, " [%f,%f]", &target[0], &target[1])) {
+				fprintf (stderr, "Invalid expression: %s\n", tpl);
+				return -1;
+			}
+			p->mapped  = 1;
+			p->itgt[0] = target[0];
+			p->itgt[1] = target[1];
+			p->ftgt[0] = target[0];
+			p->ftgt[1] = target[1];
+			return 0;
+		default:
+			fprintf (stderr, "Invalid Placeholder: %s\n", tpl);
+			return -1;
+	}
+
+	/* default source-range matches the selected parameter */
+	p->src[0] = smin;
+	p->src[1] = smax;
+
+	if (*expr == '\0') {
+		p->mapped = 0;
+		return 0;
+	}
+
+	if (type == LO_INT32) {
+		int itarget[2];
+		n = sscanf(expr, " [%i,%i] [%i,%i]", &itarget[0], &itarget[1], &p->src[0], &p->src[1]);
+		target[0] = itarget[0];
+		target[1] = itarget[1];
+	} else {
+		n = sscanf(expr, " [%f,%f] [%i,%i]", &target[0], &target[1], &p->src[0], &p->src[1]);
+	}
+
+	if (n != 2 && n != 4) {
+		fprintf (stderr, "Invalid expression: %s\n", tpl);
+		return -1;
+	}
+
+	if (p->src[0] >= p->src[1] || p->src[0] < smin || p->src[1] > smax) {
+		fprintf (stderr, "Invalid Range: %s\n", tpl);
+		return -1;
+	}
+
+	p->mapped  = 1;
+	p->itgt[0] = target[0];
+	p->itgt[1] = target[1];
+	p->ftgt[0] = target[0];
+	p->ftgt[1] = target[1];
+	p->fscale  = (target[1] - target[0]) / (float)(p->src[1] - p->src[0]);
+	return 0;
+}
+
+/* grow an array of the rule-set geometrically to hold `n` elements */
+static int ruleset_reserve (void **data, unsigned int *alloc, const size_t n, const size_t size) {
+	size_t a = *alloc ? *alloc : 64;
+	if (n <= *alloc) {
+		return 0;
+	}
+	while (a < n) {
+		a *= 2;
+	}
+	void *tmp = realloc (*data, a * size);
+	if (!tmp) {
+		fprintf (stderr, "Out of memory for rule(s).\n");
+		return -1;
+	}
+	*data = tmp;
+	*alloc = a;
+	return 0;
+}
+
+static inline uint32_t intern_hash (const char *str, const size_t len) {
+	uint32_t h = 2166136261u; // FNV-1a
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		h = (h ^ (uint8_t) str[i]) * 16777619u;
+	}
+	return h;
+}
+
+static int intern_grow (RuleSet *rs) {
+	const unsigned int size = rs->intern_size ? 2 * rs->intern_size : 1024;
+	unsigned int *t = (unsigned int*) calloc (size, sizeof (unsigned int));
+	unsigned int i;
+	if (!t) {
+		fprintf (stderr, "Out of memory for rule(s).\n");
+		return -1;
+	}
+	for (i = 0; i < rs->intern_size; ++i) {
+		if (!rs->intern[i]) {
+			continue;
+		}
+		const char *str = &rs->arena[rs->intern[i] - 1];
+		unsigned int k = intern_hash (str, strlen (str)) & (size - 1);
+		while (t[k]) {
+			k = (k + 1) & (size - 1);
+		}
+		t[k] = rs->intern[i];
+	}
+	free (rs->intern);
+	rs->intern = t;
+	rs->intern_size = size;
+	return 0;
+}
+
+/* copy `len` bytes to the arena, sets their offset */
+static int arena_add (RuleSet *rs, const void *data, const size_t len, unsigned int *off) {
+	if (ruleset_reserve ((void**)&rs->arena, &rs->arena_alloc, rs->arena_size + len, 1)) {
+		return -1;
+	}
+	memcpy (&rs->arena[rs->arena_size], data, len);
+	*off = rs->arena_size;
+	rs->arena_size += len;
+	return 0;
+}
+
+/* add the string str[0..len) to the arena, identical strings
+ * (e.g. OSC paths shared by many rules) are stored only once */
+static int arena_intern (RuleSet *rs, const char *str, const size_t len, unsigned int *off) {
+	if (2 * (rs->intern_count + 1) > rs->intern_size && intern_grow (rs)) {
+		return -1;
+	}
+	unsigned int k = intern_hash (str, len) & (rs->intern_size - 1);
+	while (rs->intern[k]) {
+		const char *s = &rs->arena[rs->intern[k] - 1];
+		if (!strncmp (s, str, len) && s[len] == '\0') {
+			*off = rs->intern[k] - 1;
+			return 0;
+		}
+		k = (k + 1) & (rs->intern_size - 1);
+	}
+	if (arena_add (rs, str, len + 1, off)) {
+		return -1;
+	}
+	rs->arena[*off + len] = '\0';
+	rs->intern[k] = *off + 1;
+	++rs->intern_count;
+	return 0;
+}
+
+static inline void osc_write_be32 (uint8_t *d, uint32_t v) {
+	d[0] = v >> 24;
+	d[1] = v >> 16;
+	d[2] = v >> 8;
+	d[3] = v;
+}
+
+static inline uint32_t osc_read_be32 (const uint8_t *d) {
+	return ((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16) | ((uint32_t)d[2] << 8) | d[3];
+}
+
+/* OSC strings are nul-terminated and padded to a multiple of 4 bytes */
+static unsigned int osc_strlen (const char *str) {
+	return (strlen (str) + 4) & ~3;
+}
+
+/* serialize the OSC message once, constant arguments are written
+ * right away, placeholders are patched in for every event.
+ * Blobs are variable-length, the buffer is allocated for the largest
+ * possible message and arguments from the first blob onward are
+ * re-serialized for every event.
+ */
+static int serialize_osc_message (RuleSet *rs, OSCMessageTemplate *m) {
+	unsigned int j;
+	const char *path = &rs->arena[m->path];
+	OSCParam *param = &rs->params[m->param];
+	const unsigned int taglen = (strlen (m->desc) + 5) & ~3; // incl. leading ','
+	unsigned int len = osc_strlen (path) + taglen;
+
+	m->var_from = m->param_count;
+	for (j = 0; j < m->param_count; ++j) {
+		const OSCParam *p = &param[j];
+		switch (m->desc[j]) {
+			case LO_STRING:
+				len += osc_strlen (&rs->arena[p->tpl]);
+				break;
+			case LO_BLOB:
+				len += 4 + ((p->end - p->byte + 4) & ~3);
+				if (m->var_from == m->param_count) {
+					m->var_from = j;
+				}
+				break;
+			default:
+				len += 4;
+				break;
+		}
+	}
+
+	if (ruleset_reserve ((void**)&rs->pkts, &rs->pkts_alloc, rs->pkts_size + len, 1)) {
+		return -1;
+	}
+	m->pkt = rs->pkts_size;
+	m->pkt_size = len;
+	rs->pkts_size += len;
+
+	uint8_t *pkt = &rs->pkts[m->pkt];
+	uint8_t *d = pkt;
+	memset (pkt, 0, len);
+	strcpy ((char*) d, path);
+	d += osc_strlen (path);
+	d[0] = ',';
+	strcpy ((char*) &d[1], m->desc);
+	d += taglen;
+
+	for (j = 0; j < m->param_count; ++j) {
+		OSCParam *p = &param[j];
+		p->offset = d - pkt;
+		switch (m->desc[j]) {
+			case LO_INT32:
+				if (p->is_const) {
+					osc_write_be32 (d, p->ival);
+				}
+				d += 4;
+				break;
+			case LO_FLOAT:
+				if (p->is_const) {
+					union { float f; uint32_t i; } v = { p->fval };
+					osc_write_be32 (d, v.i);
+				}
+				d += 4;
+				break;
+			case LO_STRING:
+				strcpy ((char*) d, &rs->arena[p->tpl]);
+				d += osc_strlen (&rs->arena[p->tpl]);
+				break;
+			case LO_BLOB:
+				d += 4; // empty until the first event
+				break;
+		}
+	}
+	m->pkt_len = d - pkt;
+	assert (m->pkt_len <= len);
+	return 0;
+}
+
+/* append a message to the rule, which must be the last rule of the set */
+static int append_osc_message (RuleSet *rs, Rule *r, const char *path, const char *desc, const char *param) {
+	assert (path);
+	assert (desc);
+	assert (param);
+
+	const unsigned int mi = rs->msg_count;
+	const unsigned int pi = rs->param_count;
+	assert (r->msg + r->message_count == mi);
+
+	if (ruleset_reserve ((void**)&rs->msgs, &rs->msgs_alloc, mi + 1, sizeof(OSCMessageTemplate))) {
+		return -1;
+	}
+
+	OSCMessageTemplate *m = &rs->msgs[mi];
+	memset (m, 0, sizeof (OSCMessageTemplate));
+	strncpy(m->desc, desc,   sizeof(m->desc));
+	m->desc[sizeof(m->desc) - 1] = '\0';
+	m->param = pi;
+	m->dest = 1;
+
+	const unsigned int pl = strlen(m->desc);
+	if (arena_intern (rs, path, strlen (path), &m->path)
+			|| ruleset_reserve ((void**)&rs->params, &rs->params_alloc, pi + pl, sizeof(OSCParam))) {
+		return -1;
+	}
+	memset (&rs->params[pi], 0, pl * sizeof(OSCParam));
+	m->param_count = pl;
+
+	const char *t0 = param;
+	unsigned int j;
+	int err = 0;
+	for (j = 0; j < pl; ++j) {
+		OSCParam *p = &rs->params[pi + j];
+		assert (t0);
+
+		while (*t0 && *t0 != '"') { ++t0; }
+		if (!*t0) { break; }
+		assert (*t0 == '"');
+		++t0;
+		while (desc[j] != 's' && *t0 && *t0 == ' ') { ++t0; }
+		if (!*t0) { break; }
+
+		const char *tmp = strchr(t0, '"'); // TODO ignore escaped quotes
+
+		if (!tmp) { break; }
+
+		if (tmp == t0 && desc[j] != 's') {
+			break;
+		}
+		if ((err = arena_intern (rs, t0, tmp - t0, &p->tpl))) {
+			break;
+		}
+		t0 = ++tmp;
+
+		if ((err = compile_param (p, &rs->arena[p->tpl], desc[j], r, &rs->filter[r - rs->rules]))) {
+			break;
+		}
+	}
+
+	if (j != pl) {
+		if (!err) {
+			fprintf (stderr, "Invalid Config, expected %d parameters, got %d.\n", pl, j + 1);
+		}
+		return -1;
+	}
+
+	if (serialize_osc_message (rs, m)) {
+		return -1;
+	}
+	rs->msg_count = mi + 1;
+	rs->param_count = pi + pl;
+	++r->message_count;
+	return 0;
+}
+
+static int port_find (const char *name) {
+	unsigned int p;
+	for (p = 0; p < port_count; ++p) {
+		if (!strcmp (ports[p].name, name)) {
+			return p;
+		}
+	}
+	return -1;
+}
+
+/* find or add an input port, returns its index or -1 */
+static int port_add (const char *name) {
+	const int p = port_find (name);
+	if (p >= 0) {
+		return p;
+	}
+	if (port_count >= MAX_PORTS || strlen (name) == 0 || strchr (name, ':')) {
+		fprintf (stderr, "Invalid or too many input ports: '%s'\n", name);
+		return -1;
+	}
+	InputPort *ip = (InputPort*) realloc (ports, (port_count + 1) * sizeof (InputPort));
+	if (!ip) {
+		fprintf (stderr, "Out of memory for input port.\n");
+		return -1;
+	}
+	ports = ip;
+	memset (&ports[port_count], 0, sizeof (InputPort));
+	ports[port_count].name = strdup (name);
+	return port_count++;
+}
+
+/* "ANY", "<value>" or "<value>/<mask>" */
+static int parse_filter_byte (const char *prt, const uint8_t dflmask, uint8_t *mask, uint8_t *match) {
+	int param[2];
+	if (!strcasecmp(prt, "ANY")) {
+		*mask = 0x00; *match = 0x00;
+	} else if (2 == sscanf (prt, "%i/%i", &param[0], &param[1])) {
+		*mask = param[1] & 0xff;
+		*match = param[0] & 0xff;
+	} else if (1 == sscanf (prt, "%i", &param[0])) {
+		*mask = dflmask;
+		*match = param[0] & 0xff;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* "CC14 <ctrl>", "NRPN <param>" or "RPN <param>" match decoded messages */
+static int parse_decoded_filter (RuleFilter *f, const char *tmp) {
+	char type[8];
+	char arg[32];
+	int n = 0;
+	if (2 != sscanf (tmp, "%7s %31s %n", type, arg, &n) || tmp[n] != '\0') {
+		return -1;
+	}
+	f->mask[0] = 0xf0;
+	if (!strcasecmp (type, "CC14")) {
+		f->match[0] = STATUS_CC14;
+		if (parse_filter_byte (arg, 0x7f, &f->mask[1], &f->match[1])) {
+			return -1;
+		}
+	} else {
+		f->match[0] = strcasecmp (type, "RPN") ? STATUS_NRPN : STATUS_RPN;
+		if (strcasecmp (arg, "ANY")) {
+			char *end;
+			const long param = strtol (arg, &end, 0);
+			if (end == arg || *end != '\0' || param < 0 || param > 0x3fff) {
+				return -1;
+			}
+			f->mask[1] = f->mask[2] = 0x7f;
+			f->match[1] = param >> 7;
+			f->match[2] = param & 0x7f;
+		}
+	}
+	f->len = 3;
+	return 0;
+}
+
+static inline int rule_is_decoded (const RuleFilter *f) {
+	return (f->mask[0] & 0x80) && !(f->match[0] & 0x80);
+}
+
+/* "SysEx [prefix...]" matches System Exclusive messages of any length */
+static int parse_sysex_filter (RuleSet *rs, Rule *r, RuleFilter *f, char *tmp) {
+	uint8_t mask[2 * MAX_SYSEX_FILTER]; // mask, followed by match
+	uint8_t match[MAX_SYSEX_FILTER];
+	unsigned int n = 0;
+	char *prt;
+
+	for (prt = strtok(tmp, " "); prt; prt = strtok(NULL, " "), ++n) {
+		if (n >= MAX_SYSEX_FILTER) {
+			fprintf(stderr, "SysEx filter exceeds %d bytes\n", MAX_SYSEX_FILTER);
+			return -1;
+		}
+		if (parse_filter_byte (prt, 0x7f, &mask[n], &match[n])) {
+			fprintf(stderr, "Failed to parse SysEx filter\n");
+			return -1;
+		}
+	}
+
+	f->mask[0] = 0xff; f->match[0] = 0xf0;
+	f->len = 0;
+	if (n == 0) {
+		return 0;
+	}
+
+	memcpy (&mask[n], match, n);
+	if (arena_add (rs, mask, 2 * n, &r->sysex)) {
+		return -1;
+	}
+	r->sysex_len = n;
+	/* first data byte (manufacturer ID) is used by the rule index */
+	f->mask[1] = mask[0]; f->match[1] = match[0];
+	return 0;
+}
+
+static Rule *new_rule (RuleSet *rs, const char *flt) {
+	const unsigned int rc = rs->rule_count;
+	unsigned int alloc = rs->rules_alloc;
+	if (ruleset_reserve ((void**)&rs->rules, &alloc, rc + 1, sizeof(Rule))
+			|| ruleset_reserve ((void**)&rs->filter, &rs->rules_alloc, rc + 1, sizeof(RuleFilter))) {
+		return NULL;
+	}
+	++rs->rule_count;
+
+	Rule *r = &rs->rules[rc];
+	RuleFilter *f = &rs->filter[rc];
+	memset(r, 0, sizeof(Rule));
+	memset(f, 0, sizeof(RuleFilter));
+	r->msg = rs->msg_count;
+	f->group = -1;
+
+	char *tmp, *fre, *prt;
+	int i = 0;
+
+	tmp = fre = strdup(flt);
+
+	if (!strncasecmp (tmp, "CC14 ", 5) || !strncasecmp (tmp, "NRPN ", 5) || !strncasecmp (tmp, "RPN ", 4)) {
+		const int rv = parse_decoded_filter (f, tmp);
+		free (fre);
+		if (rv) {
+			fprintf(stderr, "Invalid filter rule...\n");
+			--rs->rule_count;
+			return NULL;
+		}
+		++rs->decoded_rules;
+		return r;
+	}
+
+	if (!strncasecmp (tmp, "SysEx", 5) && (tmp[5] == '\0' || tmp[5] == ' ')) {
+		const int rv = parse_sysex_filter (rs, r, f, tmp + 5);
+		free (fre);
+		if (rv) {
+			--rs->rule_count;
+			return NULL;
+		}
+		return r;
+	}
+
+	for (prt = strtok(tmp, " "); prt; prt = strtok(NULL, " "), ++i) {
+		if (i >= 3) {
+			i = -1;
+			break;
+		}
+		if (i == 0 && !strcasecmp(prt, "NOTE")) {
+			f->mask[i] = 0xe0; f->match[i] = 0x80;
+		} else if (i == 0 && !strcasecmp(prt, "NOTEOFF")) {
+			f->mask[i] = 0xf0; f->match[i] = 0x80;
+		} else if (i == 0 && !strcasecmp(prt, "NOTEON")) {
+			f->mask[i] = 0xf0; f->match[i] = 0x90;
+		} else if (i == 0 && !strcasecmp(prt, "KeyPressure")) {
+			f->mask[i] = 0xf0; f->match[i] = 0xa0; // Aftertouch, 3 bytes
+		} else if (i == 0 && !strcasecmp(prt, "CC")) {
+			f->mask[i] = 0xf0; f->match[i] = 0xb0;
+		} else if (i == 0 && !strcasecmp(prt, "PGM")) {
+			f->mask[i] = 0xf0; f->match[i] = 0xc0;
+		} else if (i == 0 && !strcasecmp(prt, "ChanPressure")) {
+			f->mask[i] = 0xf0; f->match[i] = 0xd0; // Aftertouch, 2 bytes
+		} else if (i == 0 && !strcasecmp(prt, "Pitch")) {
+			f->mask[i] = 0xf0; f->match[i] = 0xe0;
+		} else if (i == 0 && !strcasecmp(prt, "Pos")) {
+			f->mask[i] = 0xff; f->match[i] = 0xf2; // Song Position Pointer, 3 bytes
+		} else if (i == 0 && !strcasecmp(prt, "Song")) {
+			f->mask[i] = 0xff; f->match[i] = 0xf3; // Song select 2 bytes
+		} else if (i == 0 && !strcasecmp(prt, "Start")) {
+			f->mask[i] = 0xff; f->match[i] = 0xfa; // rt 1 byte
+		} else if (i == 0 && !strcasecmp(prt, "Cont")) {
+			f->mask[i] = 0xff; f->match[i] = 0xfb; // rt 1 byte
+		} else if (i == 0 && !strcasecmp(prt, "Stop")) {
+			f->mask[i] = 0xff; f->match[i] = 0xfc; // rt 1 byte
+		} else if (i == 0 && !strcasecmp(prt, "NoteRC")) {
+			f->mask[i] = 0xf0; f->match[i] = STATUS_PNRC; // MIDI 2.0 per-note controllers
+		} else if (i == 0 && !strcasecmp(prt, "NoteAC")) {
+			f->mask[i] = 0xf0; f->match[i] = STATUS_PNAC;
+		} else if (i == 0 && !strcasecmp(prt, "NotePitch")) {
+			f->mask[i] = 0xf0; f->match[i] = STATUS_PNPB;
+		} else if (parse_filter_byte (prt, (i == 0 || (i == 2 && filter_is_pernote_cc (f->mask[0], f->match[0]))) ? 0xff : 0x7f, &f->mask[i], &f->match[i])) {
+			fprintf(stderr, "Failed to parse rule filter\n");
+			i = -1;
+			break;
+		}
+	}
+	free (fre);
+	if (i < 1 || i > 3) {
+		fprintf(stderr, "Invalid filter rule...\n");
+		--rs->rule_count;
+		return NULL;
+	}
+	// TODO sanity check  message-type, len
+	f->len = i; // TODO allow 'len=0' catch all
+	if (rule_is_decoded (f)) {
+		f->len = 3;
+		if (f->match[0] <= STATUS_RPN) {
+			/* given as status-byte, e.g. cfg-dump */
+			++rs->decoded_rules;
+		}
+	}
+	return r;
+}
+
+/* add rule `ri` to all buckets it is a candidate for. With `fill` unset
+ * only the buckets' sizes are counted, otherwise `count` is the fill
+ * position of the bucket in RuleSet.index_list.
+ */
+static int rule_index_add (RuleSet *rs, const unsigned int ri, const int fill) {
+	const RuleFilter *f = &rs->filter[ri];
+	const unsigned int p = rs->rules[ri].port;
+	unsigned int s, b;
+
+	for (s = 0; s < 256; ++s) {
+		StatusBucket *sb = &rs->index[p][s];
+		if ((s & f->mask[0]) != f->match[0] || (s < 0x80 && !rule_is_decoded (f))) {
+			continue;
+		}
+		if (f->mask[1] == 0) {
+			if (fill) {
+				rs->index_list[sb->wild.off + sb->wild.count] = ri;
+			}
+			++sb->wild.count;
+			continue;
+		}
+		if (!sb->data1 && !(sb->data1 = (RuleBucket*) calloc (256, sizeof (RuleBucket)))) {
+			fprintf (stderr, "Out of memory for rule index.\n");
+			return -1;
+		}
+		for (b = 0; b < 256; ++b) {
+			if ((b & f->mask[1]) != f->match[1]) {
+				continue;
+			}
+			if (fill) {
+				rs->index_list[sb->data1[b].off + sb->data1[b].count] = ri;
+			}
+			++sb->data1[b].count;
+		}
+	}
+	return 0;
+}
+
+/* Every rule is expanded into the buckets it covers, twice:
+ * the first pass counts the size of each bucket, the second one
+ * fills the lists. Rules are visited in config order.
+ */
+static int build_rule_index (RuleSet *rs) {
+	unsigned int i, b, j;
+
+	rs->index = calloc (port_count, sizeof (*rs->index));
+	if (!rs->index) {
+		fprintf (stderr, "Out of memory for rule index.\n");
+		return -1;
+	}
+
+	for (j = 0; j < rs->rule_count; ++j) {
+		if (rule_index_add (rs, j, 0)) {
+			return -1;
+		}
+	}
+
+	/* lay out the lists, and rewind the buckets for the second pass */
+	rs->index_size = 0;
+	for (i = 0; i < 256 * port_count; ++i) {
+		StatusBucket *sb = &rs->index[i / 256][i % 256];
+		sb->wild.off = rs->index_size;
+		rs->index_size += sb->wild.count;
+		sb->wild.count = 0;
+		for (b = 0; sb->data1 && b < 256; ++b) {
+			sb->data1[b].off = rs->index_size;
+			rs->index_size += sb->data1[b].count;
+			sb->data1[b].count = 0;
+		}
+	}
+
+	if (rs->index_size > 0 && !(rs->index_list = (unsigned int*) malloc (rs->index_size * sizeof (unsigned int)))) {
+		fprintf (stderr, "Out of memory for rule index.\n");
+		return -1;
+	}
+
+	for (j = 0; j < rs->rule_count; ++j) {
+		rule_index_add (rs, j, 1);
+	}
+	return 0;
+}
+
+/* "toggle", "counter [<min> <max>]" or "last" */
+static int parse_rule_state (RuleSet *rs, Rule *r, const char *arg) {
+	int lo = 0;
+	int hi = 127;
+	if (!strcasecmp (arg, "toggle")) {
+		r->state = StateToggle;
+		hi = 1;
+	} else if (!strcasecmp (arg, "last")) {
+		r->state = StateLast;
+	} else if (!strncasecmp (arg, "counter", 7) && (arg[7] == '\0' || arg[7] == ' ')) {
+		if (arg[7] != '\0' && 2 != sscanf (arg + 7, " %i %i", &lo, &hi)) {
+			return -1;
+		}
+		if (lo >= hi || lo < -65536 || hi > 65536) {
+			return -1;
+		}
+		r->state = StateCounter;
+	} else {
+		return -1;
+	}
+	r->state_min = lo;
+	r->state_max = hi;
+	r->state_off = rs->state_size;
+	rs->state_size += STATE_SLOTS;
+	return 0;
+}
+
+/* preallocate the state of all rules in one block */
+static int state_alloc (RuleSet *rs) {
+	unsigned int i, j;
+	if (rs->state_size == 0) {
+		return 0;
+	}
+	rs->state = (int32_t*) malloc (rs->state_size * sizeof (int32_t));
+	if (!rs->state) {
+		fprintf (stderr, "Out of memory for rule state.\n");
+		return -1;
+	}
+	for (i = 0; i < rs->rule_count; ++i) {
+		const Rule *r = &rs->rules[i];
+		if (r->state == StateNone) {
+			continue;
+		}
+		/* counters start at zero, or the closest value in range */
+		const int32_t init = r->state_min > 0 ? r->state_min : (r->state_max < 0 ? r->state_max : 0);
+		for (j = 0; j < STATE_SLOTS; ++j) {
+			rs->state[r->state_off + j] = init;
+		}
+	}
+	return 0;
+}
+
+/* find or add an OSC destination, returns its index or -1.
+ * The default destination (name == NULL) is always at index 0.
+ */
+static int dest_add (const char *name) {
+	unsigned int i;
+	if (dest_count == 0) {
+		if (!(dests = (OSCDest*) calloc (1, sizeof (OSCDest)))) {
+			fprintf (stderr, "Out of memory for OSC destination.\n");
+			return -1;
+		}
+		dests[0].fd = -1;
+		dest_count = 1;
+	}
+	if (!name) {
+		return 0;
+	}
+	for (i = 1; i < dest_count; ++i) {
+		if (!strcmp (dests[i].name, name)) {
+			return i;
+		}
+	}
+	if (dest_count >= MAX_DESTS || strlen (name) == 0) {
+		fprintf (stderr, "Invalid or too many OSC destinations: '%s'\n", name);
+		return -1;
+	}
+	OSCDest *d = (OSCDest*) realloc (dests, (dest_count + 1) * sizeof (OSCDest));
+	if (!d) {
+		fprintf (stderr, "Out of memory for OSC destination.\n");
+		return -1;
+	}
+	dests = d;
+	memset (&dests[dest_count], 0, sizeof (OSCDest));
+	dests[dest_count].name = strdup (name);
+	dests[dest_count].fd = -1;
+	return dest_count++;
+}
+
+static int dest_find (const char *name) {
+	unsigned int i;
+	if (!strcmp (name, "default")) {
+		return dest_add (NULL);
+	}
+	for (i = 1; i < dest_count; ++i) {
+		if (!strcmp (dests[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int parse_osc_addr (const char *name, const char *arg) {
+	char addr[1024];
+	char port[64];
+	const int i = dest_add (name);
+	if (i < 0) {
+		return -1;
+	}
+	OSCDest *d = &dests[i];
+	if (strstr (arg, "://")) {
+		/* osc.udp://, osc.tcp:// or osc.unix:// URL, optionally followed by
+		 * the stream framing: "slip" or "length" (default) */
+		char url[1024];
+		char framing[16] = "length";
+		if (sscanf (arg, "%1023s %15s", url, framing) < 1
+				|| (strcasecmp (framing, "slip") && strcasecmp (framing, "length"))) {
+			fprintf (stderr, "given OSC address '%s' is not valid\n\n", arg);
+			return -1;
+		}
+		lo_address a = lo_address_new_from_url (url);
+		if (!a) {
+			fprintf (stderr, "given OSC URL '%s' is not valid\n\n", url);
+			return -1;
+		}
+		if (d->addr) { lo_address_free (d->addr); }
+		d->addr = a;
+		d->slip = !strcasecmp (framing, "slip");
+	} else if (2 == sscanf (arg, "%[^:]:%[^:]", addr, port)) {
+		if (d->addr) { lo_address_free (d->addr); }
+		d->addr = lo_address_new (addr, port);
+	} else if (atoi (arg) > 0 && atoi (arg) < 65536) {
+		if (d->addr) { lo_address_free (d->addr); }
+		snprintf (port, sizeof (port), "%d", atoi (arg));
+		d->addr = lo_address_new (NULL, port);
+	} else {
+		fprintf (stderr, "given OSC address '%s' is not valid\n\n", arg);
+		return -1;
+	}
+	return 0;
+}
+
+/* "@name[,name...]" prefix of an OSC message line, returns a bitmask */
+static uint32_t parse_dest_list (const char *arg) {
+	char name[64];
+	uint32_t mask = 0;
+	while (1 == sscanf (arg, "%63[^, ]", name)) {
+		const int i = dest_find (name);
+		if (i < 0) {
+			fprintf (stderr, "Unknown OSC destination '%s'\n", name);
+			return 0;
+		}
+		mask |= 1u << i;
+		arg += strlen (name);
+		if (*arg != ',') {
+			break;
+		}
+		++arg;
+	}
+	return mask;
+}
+
+static int parse_sync_mode (const char *arg) {
+	if (!arg || strlen(arg) < 1) { return -1; }
+	size_t cl = strlen(arg);
+	if      (!strncasecmp(arg, "Immediate", cl)) { sync_mode = SyncImmediate; }
+	else if (!strncasecmp(arg, "Absolute", cl))  { sync_mode = SyncAbsolute; }
+	else if (!strncasecmp(arg, "Relative", cl))  { sync_mode = SyncRelative; }
+	else if (!strncasecmp(arg, "Timetag", cl))   { sync_mode = SyncTimetag; }
+	else { return -1; }
+	return 0;
+}
+
+static int parse_bundle_mode (const char *arg) {
+	if (!arg || strlen(arg) < 1) { return -1; }
+	size_t cl = strlen(arg);
+	if      (!strncasecmp(arg, "Off", cl))   { bundle_mode = BundleOff; }
+	else if (!strncasecmp(arg, "Cycle", cl)) { bundle_mode = BundleCycle; }
+	else if (!strncasecmp(arg, "Rule", cl))  { bundle_mode = BundleRule; }
+	else { return -1; }
+	return 0;
+}
+
+static int parse_mtu (const char *arg) {
+	const int mtu = atoi (arg);
+	if (mtu < 64 || mtu > 65507) {
+		fprintf (stderr, "MTU '%s' is out of range (64..65507)\n", arg);
+		return -1;
+	}
+	osc_mtu = mtu;
+	return 0;
+}
+
+static int parse_queue_size (const char *arg) {
+	char *end;
+	const long val = strtol (arg, &end, 10);
+	if (val < 1 || val > 1048576 || (*end && strcasecmp (end, "ms"))) {
+		fprintf (stderr, "Invalid queue size '%s'\n", arg);
+		return -1;
+	}
+	if (*end) {
+		queue_ms = val;
+	} else {
+		queue_ms = 0;
+		queue_size = val;
+	}
+	return 0;
+}
+
+static int parse_coalesce_window (const char *arg) {
+	char *end;
+	if (!strcasecmp (arg, "cycle")) {
+		coalesce_ms = 0;
+		return 0;
+	}
+	const long val = strtol (arg, &end, 10);
+	if (val < 0 || val > 10000 || strcasecmp (end, "ms")) {
+		return -1;
+	}
+	coalesce_ms = val;
+	return 0;
+}
+
+static int parse_overflow_policy (const char *arg) {
+	if (!arg || strlen(arg) < 1) { return -1; }
+	size_t cl = strlen(arg);
+	if      (!strncasecmp(arg, "Newest", cl))   { overflow_policy = DropNewest; }
+	else if (!strncasecmp(arg, "Oldest", cl))   { overflow_policy = DropOldest; }
+	else if (!strncasecmp(arg, "Coalesce", cl)) { overflow_policy = DropCoalesce; }
+	else { return -1; }
+	return 0;
+}
+
+static int parse_journal_size (const char *arg) {
+	const int mb = atoi (arg);
+	if (mb < 1 || mb > 65536) {
+		return -1;
+	}
+	journal_mb = mb;
+	return 0;
+}
+
+/* MIDI byte of a feedback rule: "<num>", "%<arg>" or "<num>+%<arg>".
+ * A trailing 'l' or 'h' ("%0l", "%0h") selects the low or high 7 bits
+ * of a 14bit value.
+ */
+static int parse_feedback_byte (FeedbackByte *fb, const char *tok, const int status) {
+	char *end;
+	memset (fb, 0, sizeof (FeedbackByte));
+	if (tok[0] != '%') {
+		const long val = strtol (tok, &end, 0);
+		if (end == tok || val < 0 || val > (status ? 0xff : 0x7f)) {
+			return -1;
+		}
+		fb->base = val;
+		if (*end == '\0') {
+			return 0;
+		}
+		if (end[0] != '+' || end[1] != '%') {
+			return -1;
+		}
+		tok = end + 1;
+	}
+	const long arg = strtol (tok + 1, &end, 10);
+	if (end == tok + 1 || arg < 0 || arg > 255) {
+		return -1;
+	}
+	fb->arg = arg;
+	if      (!strcmp (end, ""))  { fb->mode = FbArg; }
+	else if (!strcmp (end, "l")) { fb->mode = FbArgLSB; }
+	else if (!strcmp (end, "h")) { fb->mode = FbArgMSB; }
+	else { return -1; }
+	return 0;
+}
+
+/* "/osc/path" "types" <status> [<data1> [<data2>]] */
+static int parse_feedback_rule (const char *line) {
+	char path[1024], types[64], bytes[1024];
+	char *tok;
+	FeedbackRule fr;
+
+	memset (&fr, 0, sizeof (FeedbackRule));
+	if (3 != sscanf (line, "\"%1023[^\"]\" \"%63[^\"]\" %1023[^\n]", path, types, bytes)) {
+		types[0] = '\0';
+		if (2 != sscanf (line, "\"%1023[^\"]\" \"\" %1023[^\n]", path, bytes)) {
+			return -1;
+		}
+	}
+
+	for (tok = strtok (bytes, " \t"); tok; tok = strtok (NULL, " \t")) {
+		if (fr.len == 3 || parse_feedback_byte (&fr.b[fr.len], tok, fr.len == 0)) {
+			return -1;
+		}
+		++fr.len;
+	}
+	if (fr.len == 0 || fr.b[0].base < 0x80 || fr.b[0].base >= 0xf0) {
+		return -1;
+	}
+
+	FeedbackRule *f = (FeedbackRule*) realloc (feedback, (feedback_count + 1) * sizeof (FeedbackRule));
+	if (!f) {
+		return -1;
+	}
+	feedback = f;
+	fr.path  = strdup (path);
+	fr.types = strlen (types) > 0 ? strdup (types) : NULL;
+	feedback[feedback_count++] = fr;
+	return 0;
+}
+
+/* config files are parsed in two passes:
+ * ParseSettings reads [config], [port] and [feedback] sections and adds
+ * input ports, rules are skipped. ParseRules adds the rules to the given
+ * rule-set, ports must already exist (they are registered with JACK at
+ * startup). Rules are read on startup (unless cached) and on reload.
+ */
+enum {ParseSettings = 0, ParseRules};
+
+static int read_config (const char *configfile, RuleSet *rs, const int mode) {
+	const int reload = mode == ParseRules;
+	FILE *f;
+	char line[MAX_CFG_LINE_LEN];
+
+	if (!(f = fopen(configfile, "r"))) {
+		fprintf (stderr, "Cannot open config '%s' for reading.\n", configfile);
+		return -1;
+	} else if (mode == ParseSettings) {
+		printf ("Reading config '%s'\n", configfile);
+	}
+
+	int rv = 0;
+	int lineno = 0;
+	Rule *r = NULL;
+	int port = -1; // rules outside a [port] section apply to the default port
+	enum {NoRule, StartRule, InRule, InConfig, InPort, InFeedback} parser_state = NoRule;
+
+	// read file line by line
+	while (fgets (line, MAX_CFG_LINE_LEN - 1, f) != NULL ) {
+		++lineno;
+
+		size_t len = strlen (line);
+		if (len == MAX_CFG_LINE_LEN - 1) {
+			fprintf (stderr, "Too long line: %d\n", lineno);
+			continue;
+		}
+
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t')) {
+			line[--len] = '\0';
+		}
+
+		if (len == 0 || line[0] == '#') {
+			continue;
+		}
+
+		if (!strcmp (line, "[config]")) {
+			if (parser_state == StartRule) {
+				rv = -1;
+				goto parser_end;
+			}
+			parser_state = InConfig;
+		}
+		else if (!strcmp (line, "[feedback]")) {
+			if (parser_state == StartRule) {
+				rv = -1;
+				goto parser_end;
+			}
+			parser_state = InFeedback;
+		}
+		else if (!strcmp (line, "[rule]")) {
+			if (parser_state == StartRule) {
+				rv = -1;
+				goto parser_end;
+			}
+			parser_state = StartRule;
+		}
+		else if (!strncmp (line, "[port ", 6) && line[len - 1] == ']') {
+			if (parser_state == StartRule) {
+				rv = -1;
+				goto parser_end;
+			}
+			line[len - 1] = '\0';
+			if ((port = reload ? port_find (line + 6) : port_add (line + 6)) < 0) {
+				if (reload) {
+					fprintf (stderr, "Cannot add input port '%s' at runtime, restart required.\n", line + 6);
+				}
+				rv = -1;
+				goto parser_end;
+			}
+			parser_state = InPort;
+		}
+		else if (mode == ParseSettings && parser_state == InRule) {
+			continue;
+		}
+		else if (parser_state == InRule && !strncasecmp (line, "state ", 6)) {
+			assert (r);
+			if (r->state != StateNone || parse_rule_state (rs, r, line + 6)) {
+				fprintf (stderr, "Invalid rule state, line: %d\n", lineno);
+			}
+		}
+		else if (parser_state == InRule && !strncasecmp (line, "group ", 6)) {
+			assert (r);
+			const int g = atoi (line + 6);
+			if (g < 0 || g > 15) {
+				fprintf (stderr, "Invalid UMP group, line: %d\n", lineno);
+			} else {
+				rs->filter[r - rs->rules].group = g;
+			}
+		}
+		else if (parser_state == InRule && !strcasecmp (line, "coalesce")) {
+			assert (r);
+			if (!r->coalesce) {
+				r->coalesce = 1;
+				++rs->coalesce_rules;
+			}
+		}
+		else if (parser_state == InRule) {
+			assert (r);
+			// TODO split properly, check lengths, allow escaped quotes in path
+			char a[1024], b[16], c[1024];
+			const char *msg = line;
+			uint32_t dest = 1;
+			if (line[0] == '@') {
+				/* explicit destination(s) */
+				if (!(dest = parse_dest_list (line + 1)) || !(msg = strchr (line, ' '))) {
+					fprintf (stderr, "Invalid OSC destination. line: %d\n", lineno);
+					continue;
+				}
+				while (*msg == ' ') { ++msg; }
+			}
+			const unsigned int mc = r->message_count;
+			if (3 == sscanf (msg, "\"%[^\"]\" \"%[^\"]\" %1023c", a, b, c)) {
+				if (append_osc_message(rs, r, a, b, c)) {
+					fprintf (stderr, "Failed to append/parse OSC message from line: %d\n", lineno);
+				}
+			} else
+			if (1 == sscanf (msg, "\"%[^\"]\" \"\"", a)) {
+				if (append_osc_message(rs, r, a, "", "")) {
+					fprintf (stderr, "Failed to append/parse OSC message from line: %d\n", lineno);
+				}
+			} else {
+				fprintf (stderr, "Invalid OSC message format. line: %d\n", lineno);
+			}
+			if (r->message_count > mc) {
+				rs->msgs[r->msg + mc].dest = dest;
+			}
+		}
+		else if (parser_state == StartRule) {
+			if (port < 0 && (port = reload ? port_find ("in") : port_add ("in")) < 0) {
+				if (reload) {
+					fprintf (stderr, "Cannot add input port 'in' at runtime, restart required.\n");
+				}
+				rv = -1;
+				goto parser_end;
+			}
+			if (mode == ParseSettings) {
+				parser_state = InRule;
+				continue;
+			}
+			r = new_rule (rs, line);
+			if (r) {
+				r->port = port;
+				parser_state = InRule;
+			} else {
+				parser_state = NoRule;
+			}
+		}
+		else if (reload && (parser_state == InPort || parser_state == InConfig || parser_state == InFeedback)) {
+			continue;
+		}
+		else if (parser_state == InFeedback) {
+			if (parse_feedback_rule (line)) {
+				fprintf (stderr, "Invalid feedback rule, line: %d\n", lineno);
+			}
+		}
+		else if (parser_state == InPort) {
+			if (!strncasecmp(line, "input=", 6) && strlen(line) > 6) {
+				free (ports[port].connect);
+				ports[port].connect = strdup(line + 6);
+			} else {
+				fprintf (stderr, "Ignored port config line: %d\n", lineno);
+			}
+		}
+		else if (parser_state == InConfig) {
+			if (!strncasecmp(line, "osc=", 4) && strlen(line) > 4) {
+				parse_osc_addr(NULL, line + 4);
+			}
+			else if (!strncasecmp(line, "dest.", 5) && strchr(line, '=')) {
+				char *eq = strchr(line, '=');
+				*eq = '\0';
+				if (strlen(eq + 1) == 0 || !strcmp(line + 5, "default") || parse_osc_addr(line + 5, eq + 1)) {
+					fprintf (stderr, "Invalid OSC destination, line: %d\n", lineno);
+				}
+			}
+			else if (!strncasecmp(line, "input=", 6) && strlen(line) > 6) {
+				free (j_connect);
+				j_connect = strdup(line + 6);
+			}
+			else if (!strncasecmp(line, "syncmode=", 9) && strlen(line) > 9) {
+				parse_sync_mode(line + 9);
+			}
+			else if (!strncasecmp(line, "bundle=", 7) && strlen(line) > 7) {
+				if (parse_bundle_mode(line + 7)) {
+					fprintf (stderr, "Invalid bundle mode, line: %d\n", lineno);
+				}
+			}
+			else if (!strncasecmp(line, "mtu=", 4) && strlen(line) > 4) {
+				parse_mtu(line + 4);
+			}
+			else if (!strncasecmp(line, "coalesce=", 9) && strlen(line) > 9) {
+				if (parse_coalesce_window(line + 9)) {
+					fprintf (stderr, "Invalid coalesce window, line: %d\n", lineno);
+				}
+			}
+			else if (!strncasecmp(line, "queue=", 6) && strlen(line) > 6) {
+				parse_queue_size(line + 6);
+			}
+			else if (!strncasecmp(line, "listen=", 7) && strlen(line) > 7) {
+				free (listen_url);
+				listen_url = strdup(line + 7);
+			}
+			else if (!strncasecmp(line, "output=", 7) && strlen(line) > 7) {
+				free (out_connect);
+				out_connect = strdup(line + 7);
+			}
+			else if (!strncasecmp(line, "journal=", 8) && strlen(line) > 8) {
+				free (journal_file);
+				journal_file = strdup(line + 8);
+			}
+			else if (!strncasecmp(line, "journalsize=", 12) && strlen(line) > 12) {
+				if (parse_journal_size(line + 12)) {
+					fprintf (stderr, "Invalid journal size, line: %d\n", lineno);
+				}
+			}
+			else if (!strncasecmp(line, "stats=", 6) && strlen(line) > 6) {
+				free (stats_file);
+				stats_file = strdup(line + 6);
+			}
+			else if (!strncasecmp(line, "statsinterval=", 14) && strlen(line) > 14) {
+				stats_interval = atoi(line + 14);
+			}
+			else if (!strncasecmp(line, "ump=", 4) && strlen(line) > 4) {
+				ump_input = !strcasecmp(line + 4, "yes") || !strcmp(line + 4, "1");
+			}
+			else if (!strncasecmp(line, "overflow=", 9) && strlen(line) > 9) {
+				if (parse_overflow_policy(line + 9)) {
+					fprintf (stderr, "Invalid overflow policy, line: %d\n", lineno);
+				}
+			}
+		} else {
+			fprintf (stderr, "Ignored config line: %d\n", lineno);
+		}
+	}
+
+parser_end:
+	if (rv) {
+		fprintf (stderr, "Failed to parse config, line %d\n", lineno);
+	}
+
+	fclose(f);
+	return rv;
+
+	return 0;
+}
+
+static void *trim (void *data, const size_t size) {
+	void *tmp = realloc (data, size);
+	return (tmp || size == 0) ? tmp : data;
+}
+
+/* release the string table and spare capacity of a parsed rule-set,
+ * memory of the active set is locked */
+static void ruleset_trim (RuleSet *rs) {
+	free (rs->intern);
+	rs->intern = NULL;
+	rs->intern_size = rs->intern_count = 0;
+
+	rs->rules  = (Rule*) trim (rs->rules, rs->rule_count * sizeof (Rule));
+	rs->filter = (RuleFilter*) trim (rs->filter, rs->rule_count * sizeof (RuleFilter));
+	rs->msgs   = (OSCMessageTemplate*) trim (rs->msgs, rs->msg_count * sizeof (OSCMessageTemplate));
+	rs->params = (OSCParam*) trim (rs->params, rs->param_count * sizeof (OSCParam));
+	rs->pkts   = (uint8_t*) trim (rs->pkts, rs->pkts_size);
+	rs->arena  = (char*) trim (rs->arena, rs->arena_size);
+	rs->rules_alloc  = rs->rule_count;
+	rs->msgs_alloc   = rs->msg_count;
+	rs->params_alloc = rs->param_count;
+	rs->pkts_alloc   = rs->pkts_size;
+	rs->arena_alloc  = rs->arena_size;
+}
+
+/* rules of the user- and the given config file, in this order */
+static int read_rules (RuleSet *rs) {
+	if ((usercfgfile && read_config (usercfgfile, rs, ParseRules))
+			|| (cfgfile && read_config (cfgfile, rs, ParseRules))) {
+		return -1;
+	}
+	if (rs->rule_count == 0) {
+		fprintf (stderr, "No MIDI-> OSC Rules configured\n");
+		return -1;
+	}
+	ruleset_trim (rs);
+	return build_rule_index (rs);
+}
+
+/******************************************************************************
+ * Compiled rule cache
+ */
+
+/* binary image of a parsed rule-set and its dispatch index, written
+ * by --compile to '<config>.cache'. The arrays of the rule-set are
+ * stored as 8-byte aligned sections, their elements refer to each other
+ * by index or offset. Only the section offsets in the header and the
+ * data-byte 1 buckets of the index are relocated when loading.
+ * The image is mapped copy-on-write (templates are patched at runtime)
+ * and used if it was written by the same build for the same config.
+ * A checksum of the image guards against corrupted files.
+ */
+#define RCACHE_MAGIC   "j2orules"
+#define RCACHE_VERSION 3
+
+#define RCACHE_ABI 7
+
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint16_t abi[RCACHE_ABI]; // sizeof pointer, RuleFilter, Rule, OSCMessageTemplate, OSCParam, StatusBucket, RuleBucket
+	uint64_t hash;      // of the config file(s)
+	uint64_t image_hash; // of the image, with this field set to zero
+	uint64_t size;
+	uint32_t port_count;
+	uint32_t rule_count;
+	uint32_t coalesce_rules;
+	uint32_t decoded_rules;
+	uint32_t msg_count;
+	uint32_t param_count;
+	uint32_t pkts_size;
+	uint32_t arena_size;
+	uint32_t index_size;
+	uint32_t state_size;
+	uint64_t filter;    // offsets
+	uint64_t rules;
+	uint64_t msgs;
+	uint64_t params;
+	uint64_t pkts;
+	uint64_t arena;
+	uint64_t index;
+	uint64_t index_list;
+} RuleCacheHeader;
+
+typedef struct {
+	uint8_t *d;
+	size_t   len;
+	size_t   alloc;
+	int      error;
+} RuleCacheBuffer;
+
+static void rcache_abi (uint16_t *abi) {
+	abi[0] = sizeof (void*);
+	abi[1] = sizeof (RuleFilter);
+	abi[2] = sizeof (Rule);
+	abi[3] = sizeof (OSCMessageTemplate);
+	abi[4] = sizeof (OSCParam);
+	abi[5] = sizeof (StatusBucket);
+	abi[6] = sizeof (RuleBucket);
+}
+
+/* FNV-1a of the config file(s) rules are read from */
+static int rcache_hash (uint64_t *hash) {
+	const char *fn[2] = { usercfgfile, cfgfile };
+	uint8_t buf[8192];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+	for (i = 0; i < 2; ++i) {
+		FILE *f;
+		size_t n, j;
+		if (!fn[i]) {
+			continue;
+		}
+		if (!(f = fopen (fn[i], "rb"))) {
+			return -1;
+		}
+		while ((n = fread (buf, 1, sizeof (buf), f)) > 0) {
+			for (j = 0; j < n; ++j) {
+				h = (h ^ buf[j]) * 0x100000001b3ULL;
+			}
+		}
+		fclose (f);
+		h = (h ^ 0xff) * 0x100000001b3ULL; // file separator
+	}
+	*hash = h;
+	return 0;
+}
+
+/* FNV-1a of the image, 64bit words at a time */
+static uint64_t rcache_image_hash (uint64_t h, const uint8_t *d, size_t len) {
+	uint64_t w;
+	for (; len >= 8; d += 8, len -= 8) {
+		memcpy (&w, d, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	for (; len > 0; ++d, --len) {
+		h = (h ^ *d) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* checksum of the complete image, the stored image_hash counts as zero */
+static uint64_t rcache_image_check (const uint8_t *img, const size_t size) {
+	const size_t off = offsetof (RuleCacheHeader, image_hash);
+	const uint8_t zero[8] = { 0 };
+	uint64_t h = rcache_image_hash (0xcbf29ce484222325ULL, img, off);
+	h = rcache_image_hash (h, zero, 8);
+	return rcache_image_hash (h, img + off + 8, size - off - 8);
+}
+
+static char *rcache_file (void) {
+	const char *cfg = cfgfile ? cfgfile : usercfgfile;
+	if (!cfg) {
+		return NULL;
+	}
+	char *fn = (char*) malloc (strlen (cfg) + 7);
+	sprintf (fn, "%s.cache", cfg);
+	return fn;
+}
+
+/* append 8-byte aligned data (zero-filled if NULL), returns its offset */
+static size_t rcache_put (RuleCacheBuffer *b, const void *data, const size_t len) {
+	const size_t off = (b->len + 7) & ~7;
+	if (off + len > b->alloc) {
+		size_t alloc = b->alloc ? b->alloc : 65536;
+		while (off + len > alloc) {
+			alloc *= 2;
+		}
+		uint8_t *tmp = (uint8_t*) realloc (b->d, alloc);
+		if (!tmp) {
+			b->error = 1;
+			return 0;
+		}
+		b->d = tmp;
+		b->alloc = alloc;
+	}
+	memset (&b->d[b->len], 0, off - b->len);
+	if (data) {
+		memcpy (&b->d[off], data, len);
+	} else {
+		memset (&b->d[off], 0, len);
+	}
+	b->len = off + len;
+	return off;
+}
+
+static int rule_cache_write (const RuleSet *rs) {
+	RuleCacheBuffer b = { NULL, 0, 0, 0 };
+	RuleCacheHeader h;
+	unsigned int i;
+	char *fn, *tmp;
+	FILE *f;
+	int rv = -1;
+
+	if (!(fn = rcache_file ())) {
+		fprintf (stderr, "No config file to compile.\n");
+		return -1;
+	}
+
+	memset (&h, 0, sizeof (RuleCacheHeader));
+	memcpy (h.magic, RCACHE_MAGIC, 8);
+	h.version        = RCACHE_VERSION;
+	h.port_count     = port_count;
+	h.rule_count     = rs->rule_count;
+	h.coalesce_rules = rs->coalesce_rules;
+	h.decoded_rules  = rs->decoded_rules;
+	h.msg_count      = rs->msg_count;
+	h.param_count    = rs->param_count;
+	h.pkts_size      = rs->pkts_size;
+	h.arena_size     = rs->arena_size;
+	h.index_size     = rs->index_size;
+	h.state_size     = rs->state_size;
+	rcache_abi (h.abi);
+	if (rcache_hash (&h.hash)) {
+		fprintf (stderr, "Cannot read config file(s).\n");
+		goto out;
+	}
+
+	rcache_put (&b, NULL, sizeof (RuleCacheHeader));
+	h.filter = rcache_put (&b, rs->filter, rs->rule_count * sizeof (RuleFilter));
+	h.rules  = rcache_put (&b, rs->rules, rs->rule_count * sizeof (Rule));
+	h.msgs   = rcache_put (&b, rs->msgs, rs->msg_count * sizeof (OSCMessageTemplate));
+	h.params = rcache_put (&b, rs->params, rs->param_count * sizeof (OSCParam));
+	h.pkts   = rcache_put (&b, rs->pkts, rs->pkts_size);
+	h.arena  = rcache_put (&b, rs->arena, rs->arena_size);
+
+	/* the buffer may move with every rcache_put(), the index is addressed by offset */
+	h.index = rcache_put (&b, rs->index, 256 * port_count * sizeof (StatusBucket));
+	for (i = 0; i < 256 * port_count && !b.error; ++i) {
+		const StatusBucket *sb = &rs->index[i / 256][i % 256];
+		const size_t d1 = sb->data1 ? rcache_put (&b, sb->data1, 256 * sizeof (RuleBucket)) : 0;
+		if (b.error) {
+			break;
+		}
+		((StatusBucket*)&b.d[h.index])[i].data1 = (RuleBucket*)(uintptr_t) d1;
+	}
+	h.index_list = rcache_put (&b, rs->index_list, rs->index_size * sizeof (unsigned int));
+	for (i = 0; i < rs->rule_count && !b.error; ++i) {
+		((Rule*)&b.d[h.rules])[i].hits = 0;
+	}
+
+	if (b.error) {
+		fprintf (stderr, "Out of memory for rule cache.\n");
+		goto out;
+	}
+	h.size = b.len;
+	memcpy (b.d, &h, sizeof (RuleCacheHeader));
+	h.image_hash = rcache_image_check (b.d, b.len);
+	memcpy (b.d, &h, sizeof (RuleCacheHeader));
+
+	tmp = (char*) malloc (strlen (fn) + 5);
+	sprintf (tmp, "%s.tmp", fn);
+	if (!(f = fopen (tmp, "wb"))) {
+		fprintf (stderr, "Cannot write rule cache '%s'.\n", tmp);
+		free (tmp);
+		goto out;
+	}
+	if (fwrite (b.d, 1, b.len, f) != b.len) {
+		fprintf (stderr, "Cannot write rule cache '%s'.\n", tmp);
+		fclose (f);
+		unlink (tmp);
+		free (tmp);
+		goto out;
+	}
+	fclose (f);
+	if (rename (tmp, fn)) {
+		fprintf (stderr, "Cannot rename rule cache '%s': %s\n", tmp, strerror (errno));
+		unlink (tmp);
+	} else {
+		printf ("Compiled %d rules to '%s' (%zu bytes)\n", rs->rule_count, fn, b.len);
+		rv = 0;
+	}
+	free (tmp);
+
+out:
+	free (b.d);
+	free (fn);
+	return rv;
+}
+
+#ifndef _WIN32
+/* check `len` bytes at offset `off` of the image and relocate the pointer */
+#define RCACHE_RELOC(ptr, len) \
+	if (((uintptr_t)(ptr) == 0 && (len) != 0) || ((uintptr_t)(ptr) & 7) \
+			|| (uintptr_t)(ptr) > size || (size_t)(len) > size - (uintptr_t)(ptr)) { \
+		goto invalid; \
+	} \
+	(ptr) = (void*)((ptr) ? img + (uintptr_t)(ptr) : NULL);
+
+static inline int rcache_string (const RuleSet *rs, const unsigned int off) {
+	return off < rs->arena_size && memchr (&rs->arena[off], 0, rs->arena_size - off);
+}
+
+/* check that the parameters are laid out as serialize_osc_message() does */
+static int rcache_check_layout (const RuleSet *rs, const OSCMessageTemplate *m) {
+	unsigned int j;
+	unsigned int var_from = m->param_count;
+	unsigned int len = osc_strlen (&rs->arena[m->path]) + ((m->param_count + 5) & ~3);
+
+	if (!memchr (m->desc, 0, sizeof (m->desc)) || strlen (m->desc) != m->param_count) {
+		return -1;
+	}
+	for (j = 0; j < m->param_count; ++j) {
+		const OSCParam *p = &rs->params[m->param + j];
+		if (!rcache_string (rs, p->tpl) || p->offset != len) {
+			return -1;
+		}
+		switch (m->desc[j]) {
+			case LO_INT32:
+			case LO_FLOAT:
+				len += 4;
+				break;
+			case LO_STRING:
+				len += osc_strlen (&rs->arena[p->tpl]);
+				break;
+			case LO_BLOB:
+				if (p->end < p->byte) {
+					return -1;
+				}
+				len += 4 + ((p->end - p->byte + 4) & ~3);
+				if (var_from == m->param_count) {
+					var_from = j;
+				}
+				break;
+			default:
+				return -1;
+		}
+	}
+	return (len == m->pkt_size && var_from == m->var_from) ? 0 : -1;
+}
+
+/* check that all indices and offsets are in range */
+static int rcache_check (const RuleSet *rs) {
+	unsigned int i, j;
+	const unsigned int nd = dest_count > 0 ? dest_count : 1; // default destination is added later
+	for (i = 0; i < rs->rule_count; ++i) {
+		const Rule *r = &rs->rules[i];
+		if (r->port >= port_count
+				|| (r->state != StateNone && (r->state_off > rs->state_size || STATE_SLOTS > rs->state_size - r->state_off))
+				|| r->msg > rs->msg_count || r->message_count > rs->msg_count - r->msg
+				|| r->sysex > rs->arena_size || 2 * r->sysex_len > rs->arena_size - r->sysex) {
+			return -1;
+		}
+	}
+	for (i = 0; i < rs->msg_count; ++i) {
+		const OSCMessageTemplate *m = &rs->msgs[i];
+		if (!rcache_string (rs, m->path) || m->param_count >= sizeof (m->desc)
+				|| m->param > rs->param_count || m->param_count > rs->param_count - m->param
+				|| m->pkt > rs->pkts_size || m->pkt_size > rs->pkts_size - m->pkt || m->pkt_len > m->pkt_size
+				|| m->dest == 0 || (nd < 32 && (m->dest >> nd))
+				|| rcache_check_layout (rs, m)) {
+			return -1;
+		}
+	}
+	for (i = 0; i < 256 * port_count; ++i) {
+		const StatusBucket *sb = &rs->index[i / 256][i % 256];
+		if (sb->wild.off > rs->index_size || sb->wild.count > rs->index_size - sb->wild.off) {
+			return -1;
+		}
+		for (j = 0; sb->data1 && j < 256; ++j) {
+			if (sb->data1[j].off > rs->index_size || sb->data1[j].count > rs->index_size - sb->data1[j].off) {
+				return -1;
+			}
+		}
+	}
+	for (i = 0; i < rs->index_size; ++i) {
+		if (rs->index_list[i] >= rs->rule_count) {
+			return -1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/* map the rule cache, returns 0 if the rule-set was loaded */
+static int rule_cache_load (RuleSet *rs) {
+#ifdef _WIN32
+	return -1;
+#else
+	RuleCacheHeader h;
+	uint16_t abi[RCACHE_ABI];
+	unsigned int i;
+	uint64_t hash;
+	struct stat st;
+	uint8_t *img = NULL;
+	size_t size = 0;
+	int fd;
+	char *fn = rcache_file ();
+
+	if (!fn || (fd = open (fn, O_RDONLY)) < 0) {
+		free (fn);
+		return -1;
+	}
+	if (fstat (fd, &st) || st.st_size < (off_t) sizeof (RuleCacheHeader)) {
+		close (fd);
+		goto invalid;
+	}
+	size = st.st_size;
+	img = (uint8_t*) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (img == MAP_FAILED) {
+		img = NULL;
+		goto invalid;
+	}
+
+	memcpy (&h, img, sizeof (RuleCacheHeader));
+	rcache_abi (abi);
+	if (memcmp (h.magic, RCACHE_MAGIC, 8) || h.size != size) {
+		goto invalid;
+	}
+	if (h.version != RCACHE_VERSION || memcmp (h.abi, abi, sizeof (abi))
+			|| rcache_hash (&hash) || hash != h.hash || h.port_count != port_count) {
+		printf ("Rule cache '%s' is out of date.\n", fn);
+		munmap (img, size);
+		free (fn);
+		return -1;
+	}
+	if (h.image_hash != rcache_image_check (img, size)) {
+		goto invalid;
+	}
+
+	memset (rs, 0, sizeof (RuleSet));
+	rs->rule_count     = h.rule_count;
+	rs->coalesce_rules = h.coalesce_rules;
+	rs->decoded_rules  = h.decoded_rules;
+	rs->msg_count      = h.msg_count;
+	rs->param_count    = h.param_count;
+	rs->pkts_size      = h.pkts_size;
+	rs->arena_size     = h.arena_size;
+	rs->index_size     = h.index_size;
+	rs->state_size     = h.state_size;
+	rs->filter         = (RuleFilter*)(uintptr_t) h.filter;
+	rs->rules          = (Rule*)(uintptr_t) h.rules;
+	rs->msgs           = (OSCMessageTemplate*)(uintptr_t) h.msgs;
+	rs->params         = (OSCParam*)(uintptr_t) h.params;
+	rs->pkts           = (uint8_t*)(uintptr_t) h.pkts;
+	rs->arena          = (char*)(uintptr_t) h.arena;
+	rs->index          = (StatusBucket (*)[256])(uintptr_t) h.index;
+	rs->index_list     = (unsigned int*)(uintptr_t) h.index_list;
+	RCACHE_RELOC (rs->filter, rs->rule_count * sizeof (RuleFilter));
+	RCACHE_RELOC (rs->rules, rs->rule_count * sizeof (Rule));
+	RCACHE_RELOC (rs->msgs, rs->msg_count * sizeof (OSCMessageTemplate));
+	RCACHE_RELOC (rs->params, rs->param_count * sizeof (OSCParam));
+	RCACHE_RELOC (rs->pkts, rs->pkts_size);
+	RCACHE_RELOC (rs->arena, rs->arena_size);
+	RCACHE_RELOC (rs->index, 256 * port_count * sizeof (StatusBucket));
+	RCACHE_RELOC (rs->index_list, rs->index_size * sizeof (unsigned int));
+	for (i = 0; i < 256 * port_count; ++i) {
+		RCACHE_RELOC (rs->index[i / 256][i % 256].data1, rs->index[i / 256][i % 256].data1 ? 256 * sizeof (RuleBucket) : 0);
+	}
+	if (rs->rule_count == 0 || rcache_check (rs)) {
+		goto invalid;
+	}
+
+	rs->image = img;
+	rs->image_size = size;
+	printf ("Loaded %d rules from cache '%s'\n", rs->rule_count, fn);
+	free (fn);
+	return 0;
+
+invalid:
+	fprintf (stderr, "Ignored invalid rule cache '%s'.\n", fn);
+	if (img) {
+		munmap (img, size);
+	}
+	memset (rs, 0, sizeof (RuleSet));
+	free (fn);
+	return -1;
+#endif
+}
+
+/* rules from the cache if it is up to date, else parse the config */
+static int load_rules (RuleSet *rs) {
+	if (!rule_cache_load (rs)) {
+		return 0;
+	}
+	return read_rules (rs);
+}
+
+static void dump_cfg (const RuleSet *rs) {
+	int j;
+	unsigned int p;
+	printf("\n# ----- CFG DUMP -----\n");
+	printf("[config]\n");
+	for (p = 0; p < dest_count; ++p) {
+		if (!dests[p].addr) {
+			continue;
+		}
+		if (p == 0) {
+			printf("# OSC destination\n");
+			printf("osc=");
+		} else {
+			printf("dest.%s=", dests[p].name);
+		}
+		if (lo_address_get_protocol(dests[p].addr) == LO_UDP) {
+			printf("%s:%s\n\n",
+					lo_address_get_hostname(dests[p].addr),
+					lo_address_get_port(dests[p].addr));
+		} else {
+			char *url = lo_address_get_url(dests[p].addr);
+			printf("%s%s\n\n", url, dests[p].slip ? " slip" : "");
+			free(url);
+		}
+	}
+	if (j_connect) {
+		printf("# auto-connect to jack-midi capture port\n");
+		printf("input=%s\n\n", j_connect);
+	}
+	if (ump_input) {
+		printf("# MIDI 2.0 input\n");
+		printf("ump=yes\n\n");
+	}
+	if (listen_url) {
+		printf("# OSC feedback server\n");
+		printf("listen=%s\n\n", listen_url);
+	}
+	if (out_connect) {
+		printf("# auto-connect to jack-midi playback port\n");
+		printf("output=%s\n\n", out_connect);
+	}
+	printf("\n");
+
+	if (feedback_count > 0) {
+		printf("[feedback]\n");
+		for (p = 0; p < feedback_count; ++p) {
+			const FeedbackRule *fr = &feedback[p];
+			printf("\"%s\" \"%s\"", fr->path, fr->types ? fr->types : "");
+			for (j = 0; j < fr->len; ++j) {
+				const FeedbackByte *fb = &fr->b[j];
+				if (fb->mode == FbConst) {
+					printf(" 0x%02x", fb->base);
+					continue;
+				}
+				if (fb->base > 0) {
+					printf(" 0x%02x+", fb->base);
+				} else {
+					printf(" ");
+				}
+				printf("%%%d%s", fb->arg, fb->mode == FbArgLSB ? "l" : fb->mode == FbArgMSB ? "h" : "");
+			}
+			printf("\n");
+		}
+		printf("\n");
+	}
+
+	for (p = 0; p < port_count; ++p) {
+		printf("[port %s]\n", ports[p].name);
+		if (ports[p].connect) {
+			printf("input=%s\n", ports[p].connect);
+		}
+		printf("\n");
+
+		for (j = 0; j < rs->rule_count; ++j) {
+			int i;
+			const Rule *r = &rs->rules[j];
+			const RuleFilter *f = &rs->filter[j];
+			if (r->port != p) {
+				continue;
+			}
+			printf("# rule %d\n", j);
+			if (r->sysex_len > 0 || (f->len == 0 && f->match[0] == 0xf0)) {
+				const uint8_t *sx = (const uint8_t*) &rs->arena[r->sysex];
+				printf("[rule]\nSysEx");
+				for (i = 0; i < r->sysex_len; ++i) {
+					printf(" 0x%02x/0x%02x", sx[r->sysex_len + i], sx[i]);
+				}
+			} else {
+				printf("[rule]\n0x%02x/0x%02x", f->match[0], f->mask[0]);
+			}
+			if (f->len > 1) {
+				printf(" 0x%02x/0x%02x", f->match[1], f->mask[1]);
+			}
+			if (f->len > 2) {
+				printf(" 0x%02x/0x%02x", f->match[2], f->mask[2]);
+			}
+			printf("\n");
+			if (r->state == StateToggle) {
+				printf("state toggle\n");
+			} else if (r->state == StateCounter) {
+				printf("state counter %d %d\n", r->state_min, r->state_max);
+			} else if (r->state == StateLast) {
+				printf("state last\n");
+			}
+			if (f->group >= 0) {
+				printf("group %d\n", f->group);
+			}
+			if (r->coalesce) {
+				printf("coalesce\n");
+			}
+
+			const unsigned int mc = r->message_count;
+			for (i = 0; i < mc; ++i) {
+				int k;
+				const OSCMessageTemplate *m = &rs->msgs[r->msg + i];
+				const unsigned int pl = m->param_count;
+
+				if (m->dest != 1) {
+					unsigned int d;
+					const char *sep = "@";
+					for (d = 0; d < dest_count; ++d) {
+						if (m->dest & (1u << d)) {
+							printf("%s%s", sep, d == 0 ? "default" : dests[d].name);
+							sep = ",";
+						}
+					}
+					printf(" ");
+				}
+				printf("\"%s\" \"%s\"",
+						&rs->arena[m->path], m->desc);
+
+				for (k = 0; k < pl; ++k) {
+					printf(" \"%s\"", &rs->arena[rs->params[m->param + k].tpl]);
+				}
+				printf("\n");
+			}
+			printf("\n");
+		}
+	}
+	printf("# --------------------\n");
+}
+
+/******************************************************************************
+ * OSC transport
+ */
+
+static void osc_close (OSCDest *d) {
+#ifndef _WIN32
+	if (d->fd >= 0) {
+		close (d->fd);
+	}
+#endif
+	d->fd = -1;
+}
+
+/* resolve the OSC destination and open a UDP socket to send
+ * pre-serialized messages. If this fails, fall back to liblo.
+ * TCP and Unix-socket destinations are only resolved here,
+ * the sender thread connects (and reconnects) them.
+ */
+static int osc_open (OSCDest *d) {
+#ifndef _WIN32
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+
+	osc_close (d);
+	d->raw = 0;
+	d->proto = lo_address_get_protocol (d->addr);
+
+	if (d->proto == LO_UNIX) {
+		struct sockaddr_un *sun = (struct sockaddr_un*) &d->sa;
+		const char *path = lo_address_get_port (d->addr);
+		if (!path || strlen (path) >= sizeof (sun->sun_path)) {
+			fprintf (stderr, "Invalid OSC Unix socket path.\n");
+			return -1;
+		}
+		memset (sun, 0, sizeof (struct sockaddr_un));
+		sun->sun_family = AF_UNIX;
+		strcpy (sun->sun_path, path);
+		d->salen = sizeof (struct sockaddr_un);
+		d->raw = 1;
+		return 0;
+	}
+
+	if (d->proto != LO_UDP && d->proto != LO_TCP) {
+		return -1;
+	}
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = d->proto == LO_TCP ? SOCK_STREAM : SOCK_DGRAM;
+
+	if (getaddrinfo (lo_address_get_hostname (d->addr), lo_address_get_port (d->addr), &hints, &res) || !res) {
+		fprintf (stderr, "Cannot resolve OSC destination.\n");
+		return -1;
+	}
+
+	memcpy (&d->sa, res->ai_addr, res->ai_addrlen);
+	d->salen = res->ai_addrlen;
+
+	if (d->proto == LO_UDP) {
+		d->fd = socket (res->ai_family, SOCK_DGRAM, 0);
+	}
+	freeaddrinfo (res);
+
+	d->raw = d->proto != LO_UDP || d->fd >= 0;
+	return d->raw ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+/* blocking send, called from the destination's sender thread */
+static int osc_send_now (OSCDest *d, const uint8_t *pkt, const unsigned int len) {
+	STAT_INC (d->syscalls);
+#ifndef _WIN32
+	if (d->fd >= 0) {
+		if (sendto (d->fd, pkt, len, 0, (struct sockaddr*) &d->sa, d->salen) == (ssize_t) len) {
+			STAT_INC (d->sent);
+			return 0;
+		}
+		STAT_INC (d->errors);
+		return -1;
+	}
+#endif
+	/* liblo fallback; de-serializing and sending allocates memory */
+	STAT_INC (d->alloc_sends);
+	int rv = -1;
+	lo_message msg = lo_message_deserialise ((void*) pkt, len, NULL);
+	if (msg) {
+		rv = lo_send_message (d->addr, (const char*) pkt, msg);
+		lo_message_free (msg);
+	}
+	if (rv == -1) {
+		STAT_INC (d->errors);
+		return -1;
+	}
+	STAT_INC (d->sent);
+	return 0;
+}
+
+/* pass a packet to the sender thread, never blocks.
+ * Without a sender thread, the packet is sent directly.
+ */
+static int osc_send (OSCDest *d, const uint8_t *pkt, const unsigned int len) {
+	++tx_packets;
+	if (null_sink) {
+		return 0;
+	}
+	if (!d->thread_running) {
+		return osc_send_now (d, pkt, len);
+	}
+
+	if (jack_ringbuffer_write_space (d->txq) < sizeof (TxRecord) + len) {
+		/* destination is stalled, drop rather than delaying others.
+		 * This is counted and reported per destination. */
+		++d->txq_dropped;
+		return 0;
+	}
+
+	TxRecord h;
+	h.len = len;
+	h.usec = clock_usec ();
+	/* the reader waits until the complete record is available */
+	jack_ringbuffer_write (d->txq, (const char*) &h, sizeof (TxRecord));
+	jack_ringbuffer_write (d->txq, (const char*) pkt, len);
+
+	const unsigned int used = jack_ringbuffer_read_space (d->txq);
+	if (used > d->txq_hwm) {
+		d->txq_hwm = used;
+	}
+
+	wakeup_signal (&d->txq_wakeup);
+	return 0;
+}
+
+#ifndef WIN32
+static inline void osc_stall_stats (OSCDest *d, const uint32_t t0) {
+	const uint32_t dt = (uint32_t) clock_usec () - t0;
+	if (dt > d->stall_max) {
+		STAT_SET (d->stall_max, dt);
+	}
+}
+
+/* move complete packets from the queue to txbuf, returns the number of packets */
+static unsigned int osc_txq_read (OSCDest *d) {
+	unsigned int n = 0;
+	size_t off = 0;
+	TxRecord h;
+
+	while (n < MMSG_BATCH
+			&& jack_ringbuffer_peek (d->txq, (char*) &h, sizeof (TxRecord)) == sizeof (TxRecord)
+			&& jack_ringbuffer_read_space (d->txq) >= sizeof (TxRecord) + h.len
+			&& off + h.len <= TXQ_SIZE) {
+		jack_ringbuffer_read_advance (d->txq, sizeof (TxRecord));
+		jack_ringbuffer_read (d->txq, (char*) &d->txbuf[off], h.len);
+		d->iov[n].iov_base = &d->txbuf[off];
+		d->iov[n].iov_len  = h.len;
+		off += h.len;
+		++n;
+
+		const uint32_t waited = (uint32_t) clock_usec () - h.usec;
+		if (waited > d->wait_max) {
+			STAT_SET (d->wait_max, waited);
+		}
+	}
+	return n;
+}
+
+/* send packets collected by osc_txq_read, using a single syscall if possible */
+static void osc_send_batch (OSCDest *d, const unsigned int n) {
+	unsigned int i;
+#ifdef __linux__
+	if (d->fd >= 0) {
+		for (i = 0; i < n; ++i) {
+			memset (&d->mmsg[i], 0, sizeof (struct mmsghdr));
+			d->mmsg[i].msg_hdr.msg_name    = &d->sa;
+			d->mmsg[i].msg_hdr.msg_namelen = d->salen;
+			d->mmsg[i].msg_hdr.msg_iov     = &d->iov[i];
+			d->mmsg[i].msg_hdr.msg_iovlen  = 1;
+		}
+		i = 0;
+		while (i < n) {
+			const uint32_t t0 = clock_usec ();
+			const int rv = sendmmsg (d->fd, &d->mmsg[i], n - i, 0);
+			osc_stall_stats (d, t0);
+			STAT_INC (d->syscalls);
+			if (rv <= 0) {
+				STAT_INC (d->errors); // skip the packet that failed
+				++i;
+				continue;
+			}
+			STAT_ADD (d->sent, rv);
+			i += rv;
+		}
+		return;
+	}
+#endif
+	for (i = 0; i < n; ++i) {
+		const uint32_t t0 = clock_usec ();
+		osc_send_now (d, (const uint8_t*) d->iov[i].iov_base, d->iov[i].iov_len);
+		osc_stall_stats (d, t0);
+	}
+}
+
+static void *osc_sender (void *arg) {
+	OSCDest *d = (OSCDest*) arg;
+
+	while (1) {
+		const int done = d->thread_exit;
+		unsigned int n;
+		while ((n = osc_txq_read (d)) > 0) {
+			osc_send_batch (d, n);
+		}
+		if (done) {
+			break;
+		}
+		wakeup_wait (&d->txq_wakeup, -1);
+	}
+	return NULL;
+}
+#endif
+
+/* SLIP (RFC 1055) as used by OSC 1.1 stream transports, double-ended */
+#define SLIP_END     0300
+#define SLIP_ESC     0333
+#define SLIP_ESC_END 0334
+#define SLIP_ESC_ESC 0335
+
+/* frame packets collected by osc_txq_read into d->stream, returns the size */
+static size_t osc_stream_frame (OSCDest *d, const unsigned int n) {
+	unsigned int i;
+	uint8_t *o = d->stream;
+	for (i = 0; i < n; ++i) {
+		const uint8_t *p = (const uint8_t*) d->iov[i].iov_base;
+		const size_t len = d->iov[i].iov_len;
+		if (d->slip) {
+			size_t k;
+			*o++ = SLIP_END;
+			for (k = 0; k < len; ++k) {
+				switch (p[k]) {
+					case SLIP_END: *o++ = SLIP_ESC; *o++ = SLIP_ESC_END; break;
+					case SLIP_ESC: *o++ = SLIP_ESC; *o++ = SLIP_ESC_ESC; break;
+					default:       *o++ = p[k]; break;
+				}
+			}
+			*o++ = SLIP_END;
+		} else {
+			osc_write_be32 (o, len);
+			memcpy (o + 4, p, len);
+			o += 4 + len;
+		}
+	}
+	return o - d->stream;
+}
+
+/* connect with a timeout, a stalled peer must not block the sender
+ * thread indefinitely: a send that times out drops the connection */
+static int osc_stream_connect (OSCDest *d) {
+	struct pollfd pfd;
+	struct timeval tv;
+	int err = 0;
+	socklen_t errlen = sizeof (err);
+
+	d->fd = socket (d->sa.ss_family, SOCK_STREAM, 0);
+	if (d->fd < 0) {
+		return -1;
+	}
+	const int flags = fcntl (d->fd, F_GETFL);
+	if (flags < 0 || fcntl (d->fd, F_SETFL, flags | O_NONBLOCK)) {
+		osc_close (d);
+		return -1;
+	}
+	if (connect (d->fd, (struct sockaddr*) &d->sa, d->salen)) {
+		if (errno != EINPROGRESS) {
+			osc_close (d);
+			return -1;
+		}
+		pfd.fd = d->fd;
+		pfd.events = POLLOUT;
+		if (poll (&pfd, 1, STREAM_TIMEOUT_MS) != 1
+				|| getsockopt (d->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+			osc_close (d);
+			return -1;
+		}
+	}
+	tv.tv_sec  = STREAM_TIMEOUT_MS / 1000;
+	tv.tv_usec = (STREAM_TIMEOUT_MS % 1000) * 1000;
+	if (fcntl (d->fd, F_SETFL, flags) || setsockopt (d->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv))) {
+		osc_close (d);
+		return -1;
+	}
+	if (d->proto == LO_TCP) {
+		/* writes are already coalesced per batch */
+		const int one = 1;
+		setsockopt (d->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+	}
+	return 0;
+}
+
+static int osc_stream_write (OSCDest *d, const size_t len) {
+	size_t off = 0;
+	while (off < len) {
+		const uint32_t t0 = clock_usec ();
+#ifdef MSG_NOSIGNAL
+		const ssize_t rv = send (d->fd, &d->stream[off], len - off, MSG_NOSIGNAL);
+#else
+		const ssize_t rv = send (d->fd, &d->stream[off], len - off, 0);
+#endif
+		osc_stall_stats (d, t0);
+		STAT_INC (d->syscalls);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return -1;
+		}
+		off += rv;
+	}
+	return 0;
+}
+
+/* sender thread for TCP and Unix-socket destinations.
+ * The connection is kept open, and re-established with exponential
+ * backoff. Packets that arrive while disconnected stay queued until
+ * the queue is full.
+ */
+static void *osc_stream_sender (void *arg) {
+	OSCDest *d = (OSCDest*) arg;
+	const char *name = d->name ? d->name : "default";
+	uint32_t backoff_ms = 0;
+	int ever_connected = 0;
+
+	while (1) {
+		const int done = d->thread_exit;
+
+		if (d->fd < 0) {
+			if (osc_stream_connect (d)) {
+				if (done) {
+					break;
+				}
+				backoff_ms = backoff_ms == 0 ? 100 : backoff_ms * 2;
+				if (backoff_ms > RECONNECT_MAX_MS) {
+					backoff_ms = RECONNECT_MAX_MS;
+				}
+				/* early wakeups (new packets) just retry sooner */
+				wakeup_wait (&d->txq_wakeup, backoff_ms * 1000LL);
+				continue;
+			}
+			if (want_verbose > 0) {
+				printf ("OSC destination '%s': connected.\n", name);
+			}
+			if (ever_connected) {
+				STAT_INC (d->reconnects);
+			}
+			backoff_ms = 0;
+			ever_connected = 1;
+		}
+
+		unsigned int n;
+		while (d->fd >= 0 && (n = osc_txq_read (d)) > 0) {
+			if (osc_stream_write (d, osc_stream_frame (d, n))) {
+				/* the batch is lost, the connection is re-established */
+				fprintf (stderr, "OSC destination '%s': connection lost, reconnecting.\n", name);
+				STAT_ADD (d->errors, n);
+				osc_close (d);
+				break;
+			}
+			STAT_ADD (d->sent, n);
+		}
+
+		if (d->fd < 0) {
+			continue;
+		}
+		if (done) {
+			break;
+		}
+		wakeup_wait (&d->txq_wakeup, -1);
+	}
+	return NULL;
+}
+
+/* start one sender thread per destination.
+ * On Windows packets are sent directly from the main thread.
+ */
+static int osc_sender_start (void) {
+#ifndef WIN32
+	unsigned int i;
+	for (i = 0; i < dest_count; ++i) {
+		OSCDest *d = &dests[i];
+		if (wakeup_init (&d->txq_wakeup)) {
+			fprintf (stderr, "Cannot create sender wakeup notification.\n");
+			return -1;
+		}
+		d->txq = jack_ringbuffer_create (TXQ_SIZE);
+		d->txbuf = (uint8_t*) malloc (TXQ_SIZE);
+		if (d->raw && d->proto != LO_UDP) {
+			/* worst case SLIP: every byte escaped */
+			d->stream = (uint8_t*) malloc (2 * TXQ_SIZE + 2 * MMSG_BATCH);
+		}
+		if (!d->txq || !d->txbuf || (d->raw && d->proto != LO_UDP && !d->stream)) {
+			fprintf (stderr, "Cannot allocate OSC send queue.\n");
+			return -1;
+		}
+		d->thread_exit = 0;
+		if (pthread_create (&d->thread, NULL, (d->raw && d->proto != LO_UDP) ? osc_stream_sender : osc_sender, d)) {
+			fprintf (stderr, "Cannot start OSC sender thread.\n");
+			return -1;
+		}
+		d->thread_running = 1;
+	}
+#endif
+	return 0;
+}
+
+/* send remaining queued packets and terminate sender threads */
+static void osc_sender_stop (void) {
+#ifndef WIN32
+	unsigned int i;
+	for (i = 0; i < dest_count; ++i) {
+		OSCDest *d = &dests[i];
+		if (!d->thread_running) {
+			continue;
+		}
+		d->thread_exit = 1;
+		wakeup_signal (&d->txq_wakeup);
+		pthread_join (d->thread, NULL);
+		d->thread_running = 0;
+	}
+#endif
+}
+
+static int osc_bundle_alloc (void) {
+	unsigned int i;
+	if (bundle_mode == BundleOff && sync_mode != SyncTimetag) {
+		return 0;
+	}
+	for (i = 0; i < dest_count; ++i) {
+		dests[i].bundle = (uint8_t*) malloc (osc_mtu);
+		if (!dests[i].bundle) {
+			fprintf (stderr, "Cannot allocate OSC bundle buffer.\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static inline void osc_write_bundle_head (uint8_t *d, const lo_timetag *tt) {
+	memcpy (d, "#bundle", 8);
+	osc_write_be32 (&d[8], tt->sec);
+	osc_write_be32 (&d[12], tt->frac);
+}
+
+/* close the current timed sub-bundle (Timetag sync-mode) */
+static void osc_close_sub_bundle (OSCDest *d) {
+	if (d->sub_off > 0) {
+		osc_write_be32 (&d->bundle[d->sub_off], d->bundle_len - d->sub_off - 4);
+		d->sub_off = 0;
+	}
+}
+
+/* send pending bundle, if any */
+static void osc_flush_dest (OSCDest *d) {
+	if (d->bundle_count == 0) {
+		return;
+	}
+	osc_close_sub_bundle (d);
+	if (want_verbose > 1) {
+		printf("TX: bundle, %d msg(s), %d bytes%s%s\n", d->bundle_count, d->bundle_len,
+				d->name ? " -> " : "", d->name ? d->name : "");
+	}
+	if (d->sub_count == 1) {
+		/* send single timed bundle without enclosing bundle */
+		osc_send (d, &d->bundle[20], d->bundle_len - 20);
+	} else if (d->sub_count == 0 && d->bundle_count == 1) {
+		/* send single message as-is */
+		osc_send (d, &d->bundle[20], d->bundle_len - 20);
+	} else {
+		osc_send (d, d->bundle, d->bundle_len);
+	}
+	d->bundle_len = 0;
+	d->bundle_count = 0;
+	d->sub_count = 0;
+}
+
+static void osc_flush (void) {
+	unsigned int i;
+	for (i = 0; i < dest_count; ++i) {
+		osc_flush_dest (&dests[i]);
+	}
+}
+
+/* set timetag for subsequently queued messages */
+static void osc_set_timetag (const lo_timetag *tt) {
+	unsigned int i;
+	if (tx_timetag.sec != tt->sec || tx_timetag.frac != tt->frac) {
+		for (i = 0; i < dest_count; ++i) {
+			osc_close_sub_bundle (&dests[i]);
+		}
+		tx_timetag = *tt;
+	}
+}
+
+/* send a message or add it to the current bundle */
+static int osc_queue (OSCDest *d, const uint8_t *pkt, const unsigned int len) {
+	++tx_messages;
+	++d->messages;
+
+	/* liblo fallback does not handle bundles,
+	 * send pending messages first to retain the order */
+	if (!d->bundle || !d->raw || 40 + len > osc_mtu) {
+		osc_flush_dest (d);
+		if (sync_mode == SyncTimetag && d->bundle && d->raw && 20 + len <= osc_mtu) {
+			/* send message in its own timed bundle */
+			osc_write_bundle_head (d->bundle, &tx_timetag);
+			osc_write_be32 (&d->bundle[16], len);
+			memcpy (&d->bundle[20], pkt, len);
+			return osc_send (d, d->bundle, 20 + len);
+		}
+		if (sync_mode == SyncTimetag && d->untimed++ == 0) {
+			fprintf (stderr, "Warning: OSC message (%u bytes) exceeds MTU, sent without timetag.\n", len);
+		}
+		return osc_send (d, pkt, len);
+	}
+
+	/* In Timetag sync-mode messages are added to timed sub-bundles,
+	 * all of which are contained in one immediate bundle.
+	 */
+	const int open_sub = sync_mode == SyncTimetag && d->sub_off == 0;
+
+	if (d->bundle_len + 4 + len + (open_sub ? 20 : 0) > osc_mtu) {
+		osc_flush_dest (d);
+	}
+
+	if (d->bundle_len == 0) {
+		const lo_timetag immediate = { 0, 1 };
+		osc_write_bundle_head (d->bundle, &immediate);
+		d->bundle_len = 16;
+	}
+
+	if (sync_mode == SyncTimetag && d->sub_off == 0) {
+		d->sub_off = d->bundle_len;
+		osc_write_bundle_head (&d->bundle[d->sub_off + 4], &tx_timetag);
+		d->bundle_len += 20;
+		++d->sub_count;
+	}
+
+	osc_write_be32 (&d->bundle[d->bundle_len], len);
+	memcpy (&d->bundle[d->bundle_len + 4], pkt, len);
+	d->bundle_len += 4 + len;
+	++d->bundle_count;
+
+	if (bundle_mode == BundleOff) {
+		osc_flush_dest (d);
+	}
+	return 0;
+}
+
+/******************************************************************************
+ * SysEx storage
+ *
+ * The process callback queues SysEx messages inline (header + payload).
+ * The main thread moves the payload to a pre-allocated slot, which is
+ * released once the event was dispatched.
+ */
+
+static int sysex_alloc (void) {
+	unsigned int i;
+	sysex_pool = (uint8_t*) malloc (SYSEX_SLOTS * MAX_SYSEX_SIZE);
+	sysex_free = (uint16_t*) malloc (SYSEX_SLOTS * sizeof (uint16_t));
+	if (!sysex_pool || !sysex_free) {
+		fprintf (stderr, "Out of memory for SysEx buffers.\n");
+		return -1;
+	}
+	for (i = 0; i < SYSEX_SLOTS; ++i) {
+		sysex_free[i] = SYSEX_SLOTS - 1 - i;
+	}
+	sysex_free_count = SYSEX_SLOTS;
+	return 0;
+}
+
+static void sysex_release (const MidiMessage *m) {
+	assert (sysex_free_count < SYSEX_SLOTS);
+	sysex_free[sysex_free_count++] = m->sysex;
+}
+
+/* read one event from the ringbuffer,
+ * returns 0 if a SysEx message was dropped (all slots in use)
+ */
+static int queue_read (MidiMessage *m) {
+	jack_ringbuffer_read (rb, (char*) m, sizeof (MidiMessage));
+	if (m->len <= 3) {
+		return 1;
+	}
+	if (sysex_free_count == 0) {
+		jack_ringbuffer_read_advance (rb, m->len);
+		++sysex_dropped;
+		return 0;
+	}
+	m->sysex = sysex_free[--sysex_free_count];
+	jack_ringbuffer_read (rb, (char*) &sysex_pool[m->sysex * MAX_SYSEX_SIZE], m->len);
+	return 1;
+}
+
+/* complete message, including status byte */
+static inline const uint8_t *midi_data (const MidiMessage *m) {
+	return m->len > 3 ? &sysex_pool[m->sysex * MAX_SYSEX_SIZE] : m->d;
+}
+
+static inline uint8_t midi_byte (const MidiMessage *m, const unsigned int i) {
+	return i < m->len ? midi_data (m)[i] : 0;
+}
+
+static inline int midi_value14 (const MidiMessage *m) {
+	return m->value >> 18;
+}
+
+/******************************************************************************
+ * MIDI to OSC translation
+ */
+
+/* JACK time is a monotonic microsecond clock, OSC timetags are
+ * NTP time (seconds since 1900, 32bit fraction).
+ */
+static void update_jack_ntp_offset (void) {
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	const int64_t ntp_usec = ((int64_t)tv.tv_sec + 2208988800LL) * 1000000LL + tv.tv_usec;
+	jack_ntp_offset = ntp_usec - (int64_t) clock_usec ();
+}
+
+static void frames_to_timetag (const jack_nframes_t tme, lo_timetag *tt) {
+	const int64_t usec = (int64_t) frames_to_usec (tme) + jack_ntp_offset;
+	tt->sec  = usec / 1000000;
+	tt->frac = ((uint64_t)(usec % 1000000) << 32) / 1000000;
+}
+
+static inline int param_value (const OSCParam *p, const MidiMessage *m, const int32_t sv) {
+	switch (p->source) {
+		case ParamState:
+			return sv;
+		case ParamWide:
+			return midi_value14 (m);
+		case ParamGroup:
+			return m->len <= 3 ? m->group : 0;
+		default:
+			return midi_byte (m, p->byte) & p->mask;
+	}
+}
+
+static int32_t expand_int32 (const OSCParam *p, const MidiMessage *m, const int32_t sv) {
+	if (p->is_const) {
+		return p->ival;
+	}
+
+	if (p->source == ParamFull) {
+		if (!p->mapped) return m->value >> 1;
+		return p->itgt[0] + (int32_t)(((int64_t)p->itgt[1] - p->itgt[0]) * m->value / 0xffffffffLL);
+	}
+
+	const int val = param_value (p, m, sv);
+	if (!p->mapped) return val;
+
+	if (val <= p->src[0]) return p->itgt[0];
+	if (val >= p->src[1]) return p->itgt[1];
+
+	return p->itgt[0] + (int32_t)((int64_t)(val - p->src[0]) * ((int64_t)p->itgt[1] - p->itgt[0]) / (p->src[1] - p->src[0]));
+}
+
+static float expand_float (const OSCParam *p, const MidiMessage *m, const int32_t sv) {
+	if (p->is_const) {
+		return p->fval;
+	}
+
+	if (p->source == ParamFull) {
+		const double val = m->value / 4294967295.0;
+		if (!p->mapped) return val;
+		return p->ftgt[0] + val * (p->ftgt[1] - p->ftgt[0]);
+	}
+
+	const int val = param_value (p, m, sv);
+	if (!p->mapped) return val;
+
+	if (val <= p->src[0]) return p->ftgt[0];
+	if (val >= p->src[1]) return p->ftgt[1];
+
+	return p->ftgt[0] + (val - p->src[0]) * p->fscale;
+}
+
+static int sysex_matches (const Rule *r, const MidiMessage *m) {
+	unsigned int i;
+	if (m->len <= r->sysex_len) {
+		return 0;
+	}
+	const uint8_t *d = midi_data (m);
+	const uint8_t *mask = (const uint8_t*) &ruleset.arena[r->sysex];
+	const uint8_t *match = mask + r->sysex_len;
+	for (i = 0; i < r->sysex_len; ++i) {
+		if ((d[i + 1] & mask[i]) != match[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* SysEx prefixes are checked separately, see sysex_matches() */
+static inline int rule_matches (const RuleFilter *f, const MidiMessage *m) {
+	return (f->len == 0 || f->len == m->len)
+		&& (              (m->d[0] & f->mask[0]) == f->match[0])
+		&& (m->len < 2 || (m->d[1] & f->mask[1]) == f->match[1])
+		&& (m->len < 3 || (m->d[2] & f->mask[2]) == f->match[2])
+		&& (f->group < 0 || (m->len <= 3 && m->group == f->group));
+}
+
+/* channel and key/controller, if any */
+static inline unsigned int state_slot (const MidiMessage *m) {
+	if (m->d[0] >= 0xf0) {
+		return 0;
+	}
+	if (m->d[0] < 0xc0 && m->len == 3) {
+		return ((m->d[0] & 0x0f) << 7) | (m->d[1] & 0x7f);
+	}
+	return (m->d[0] & 0x0f) << 7;
+}
+
+/* update the state of a matching rule, sets the value for "%v".
+ * returns 0 if the event does not trigger the rule (toggle release)
+ */
+static int state_update (const Rule *r, const MidiMessage *m, int32_t *sv) {
+	int32_t *s = &ruleset.state[r->state_off + state_slot (m)];
+	const int val = midi_byte (m, m->len > 2 ? 2 : 1) & 0x7f;
+	switch (r->state) {
+		case StateToggle:
+			if (val == 0) {
+				return 0; // note-on with velocity zero, button release
+			}
+			*s = !*s;
+			*sv = *s;
+			break;
+		case StateCounter:
+			{
+				/* relative encoder, 7bit two's complement: 1..63 up, 127..65 down */
+				int32_t v = *s + (val < 64 ? val : val - 128);
+				if (v < r->state_min) v = r->state_min;
+				if (v > r->state_max) v = r->state_max;
+				*s = *sv = v;
+			}
+			break;
+		case StateLast:
+			*sv = *s;
+			*s = val;
+			break;
+	}
+	return 1;
+}
+
+static void print_osc_message (const OSCMessageTemplate *t) {
+	unsigned int c;
+	const uint8_t *pkt = &ruleset.pkts[t->pkt];
+	printf("TX: %s ,%s", &ruleset.arena[t->path], t->desc);
+	for (c = 0; c < t->param_count; ++c) {
+		const uint8_t *d = &pkt[ruleset.params[t->param + c].offset];
+		union { float f; uint32_t i; } v;
+		switch (t->desc[c]) {
+			case LO_INT32:
+				printf(" %d", (int32_t) osc_read_be32 (d));
+				break;
+			case LO_FLOAT:
+				v.i = osc_read_be32 (d);
+				printf(" %f", v.f);
+				break;
+			case LO_STRING:
+				printf(" \"%s\"", (const char*) d);
+				break;
+			case LO_BLOB:
+				printf(" <%u bytes>", osc_read_be32 (d));
+				break;
+		}
+	}
+	printf("\n");
+}
+
+/* arguments following a blob move with the blob's size */
+static void serialize_osc_args (OSCMessageTemplate *t, const MidiMessage *m, const int32_t sv) {
+	unsigned int c;
+	uint8_t *pkt = &ruleset.pkts[t->pkt];
+	OSCParam *param = &ruleset.params[t->param];
+	uint8_t *d = &pkt[param[t->var_from].offset];
+
+	for (c = t->var_from; c < t->param_count; ++c) {
+		OSCParam *p = &param[c];
+		const char *tpl = &ruleset.arena[p->tpl];
+		p->offset = d - pkt;
+		switch (t->desc[c]) {
+			case LO_INT32:
+				osc_write_be32 (d, expand_int32 (p, m, sv));
+				d += 4;
+				break;
+			case LO_FLOAT:
+				{
+					union { float f; uint32_t i; } v = { expand_float (p, m, sv) };
+					osc_write_be32 (d, v.i);
+				}
+				d += 4;
+				break;
+			case LO_STRING:
+				{
+					const size_t len = strlen (tpl) + 1;
+					const unsigned int size = osc_strlen (tpl);
+					memcpy (d, tpl, len);
+					memset (d + len, 0, size - len);
+					d += size;
+				}
+				break;
+			case LO_BLOB:
+				{
+					unsigned int len = 0;
+					if (p->byte < m->len) {
+						len = (p->end < m->len ? p->end + 1 : m->len) - p->byte;
+						memcpy (d + 4, midi_data (m) + p->byte, len);
+					}
+					osc_write_be32 (d, len);
+					d += 4;
+					const unsigned int pad = (len + 3) & ~3;
+					memset (d + len, 0, pad - len);
+					d += pad;
+				}
+				break;
+		}
+	}
+	t->pkt_len = d - pkt;
+}
+
+static void expand_and_send (Rule *r, MidiMessage *m, const int32_t sv) {
+	unsigned int i,c;
+	const unsigned int mc = r->message_count;
+
+	for (i = 0; i < mc; ++i) {
+		OSCMessageTemplate *t = &ruleset.msgs[r->msg + i];
+		uint8_t *pkt = &ruleset.pkts[t->pkt];
+		const OSCParam *param = &ruleset.params[t->param];
+		const unsigned int pc = t->param_count;
+		for (c = 0; c < pc && c < t->var_from; ++c) {
+			const OSCParam *p = &param[c];
+			if (p->is_const) {
+				continue;
+			}
+			if (t->desc[c] == LO_INT32) {
+				osc_write_be32 (&pkt[p->offset], expand_int32 (p, m, sv));
+			} else {
+				union { float f; uint32_t i; } v = { expand_float (p, m, sv) };
+				osc_write_be32 (&pkt[p->offset], v.i);
+			}
+		}
+		if (t->var_from < pc) {
+			serialize_osc_args (t, m, sv);
+		}
+
+		if (want_verbose > 1) {
+			print_osc_message (t);
+		}
+
+		/* the same bytes are sent to every destination */
+		uint32_t dm = t->dest;
+		for (c = 0; dm; ++c, dm >>= 1) {
+			if ((dm & 1) && osc_queue (&dests[c], pkt, t->pkt_len)) {
+				fprintf(stderr, "Failed to send OSC message '%s'.\n", &ruleset.arena[t->path]);
+			}
+		}
+	}
+}
+
+/* match a MIDI message against all rules, send OSC for every matching rule.
+ * superseded: a later value for the same controller is pending (coalescing)
+ */
+static void dispatch (MidiMessage *m, const int superseded) {
+	unsigned int j;
+
+	/* merge the two candidate lists, retaining config order */
+	const StatusBucket *sb = &ruleset.index[m->port][m->d[0]];
+	const unsigned int *wl = &ruleset.index_list[sb->wild.off];
+	const unsigned int *dl = NULL;
+	unsigned int wc = sb->wild.count;
+	unsigned int dc = 0;
+	if (sb->data1) {
+		dl = &ruleset.index_list[sb->data1[m->d[1]].off];
+		dc = sb->data1[m->d[1]].count;
+	}
+
+	while (wc > 0 || dc > 0) {
+		if (dc == 0 || (wc > 0 && *wl < *dl)) {
+			j = *wl++; --wc;
+		} else {
+			j = *dl++; --dc;
+		}
+		if (!rule_matches (&ruleset.filter[j], m)) {
+			continue;
+		}
+		Rule *r = &ruleset.rules[j];
+		if (r->sysex_len == 0 || sysex_matches (r, m)) {
+			int32_t sv = 0;
+			/* state is updated even if the rule is coalesced */
+			if (r->state != StateNone && !state_update (r, m, &sv)) {
+				continue;
+			}
+			if (superseded && r->coalesce) {
+				if (want_verbose > 1) {
+					printf("       | Rule #%d coalesced\n", j);
+				}
+				continue;
+			}
+			if (want_verbose > 1) {
+				printf("       | Rule #%d -> %d osc msg(s)\n", j, r->message_count);
+			}
+			++r->hits;
+			expand_and_send (r, m, sv);
+			if (bundle_mode == BundleRule) {
+				osc_flush ();
+			}
+		}
+	}
+}
+
+/******************************************************************************
+ * Event scheduler (Absolute and Relative sync-mode)
+ *
+ * Events are kept in a min-heap ordered by due-time, events due at the
+ * same time retain the order in which they were received.
+ */
+
+static int sched_alloc (unsigned int size) {
+	sched = (SchedEvent*) calloc (size, sizeof (SchedEvent));
+	if (!sched) {
+		fprintf (stderr, "Cannot allocate event queue.\n");
+		return -1;
+	}
+	sched_size = size;
+	return 0;
+}
+
+/* compare with 32bit roll-over of jack_nframes_t */
+static inline int sched_before (const SchedEvent *a, const SchedEvent *b) {
+	const int32_t dt = a->m.tme - b->m.tme;
+	if (dt != 0) {
+		return dt < 0;
+	}
+	return (int32_t)(a->seq - b->seq) < 0;
+}
+
+static int sched_push (const MidiMessage *m) {
+	if (sched_len >= sched_size) {
+		return -1;
+	}
+	unsigned int i = sched_len++;
+	SchedEvent ev = { *m, sched_seq++ };
+	while (i > 0) {
+		const unsigned int p = (i - 1) / 2;
+		if (!sched_before (&ev, &sched[p])) {
+			break;
+		}
+		sched[i] = sched[p];
+		i = p;
+	}
+	sched[i] = ev;
+	return 0;
+}
+
+/* remove earliest event if it is due at `now` */
+static int sched_pop_due (const jack_nframes_t now, MidiMessage *m) {
+	if (sched_len == 0 || (int32_t)(now - sched[0].m.tme) < 0) {
+		return 0;
+	}
+	*m = sched[0].m;
+
+	const SchedEvent last = sched[--sched_len];
+	unsigned int i = 0;
+	for (;;) {
+		unsigned int c = 2 * i + 1;
+		if (c >= sched_len) {
+			break;
+		}
+		if (c + 1 < sched_len && sched_before (&sched[c + 1], &sched[c])) {
+			++c;
+		}
+		if (!sched_before (&sched[c], &last)) {
+			break;
+		}
+		sched[i] = sched[c];
+		i = c;
+	}
+	sched[i] = last;
+	return 1;
+}
+
+/* sleep until given frame-time, or until new events arrive */
+static void wait_until (const jack_nframes_t due) {
+	const int32_t dt = due - frame_time ();
+	if (dt <= 0) {
+		return;
+	}
+	wakeup_wait (&main_wakeup, ceil (dt * 1e6 / samplerate));
+}
+
+/******************************************************************************
+ * Latency measurement
+ */
+
+static inline unsigned int hist_index (const uint32_t val) {
+	if (val < HIST_SUB) {
+		return val;
+	}
+	unsigned int b = 3;
+	while (b < 31 && (val >> (b + 1)) > 0) {
+		++b;
+	}
+	return (b - 2) * HIST_SUB + ((val >> (b - 3)) & (HIST_SUB - 1));
+}
+
+/* smallest value in bucket */
+static inline uint32_t hist_value (const unsigned int i) {
+	if (i < HIST_SUB) {
+		return i;
+	}
+	return (uint32_t)(HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+static void hist_add (Histogram *h, const uint32_t val) {
+	++h->bucket[hist_index (val)];
+	++h->count;
+	h->sum += val;
+	if (val > h->max) {
+		h->max = val;
+	}
+}
+
+/* upper bound of the given quantile (0..1) */
+static uint32_t hist_quantile (const Histogram *h, const double q) {
+	unsigned int i;
+	unsigned long n = 0;
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		n += h->bucket[i];
+		if (n > 0 && n >= q * h->count) {
+			const uint32_t ub = i + 1 < HIST_BUCKETS ? hist_value (i + 1) - 1 : UINT32_MAX;
+			return ub < h->max ? ub : h->max;
+		}
+	}
+	return h->max;
+}
+
+static void latency_add (const uint32_t usec) {
+	hist_add (&latency_send, (uint32_t) clock_usec () - usec);
+}
+
+/* called when an event is read from the queue, re-stamps the event */
+static void latency_dequeue_event (MidiMessage *m) {
+	const uint32_t now = clock_usec ();
+	hist_add (&latency_dequeue, now - m->usec);
+	m->usec = now;
+}
+
+/* with bundle=cycle, messages of a dispatched event are sent with the next flush */
+static void latency_event (const uint32_t usec) {
+	if (bundle_mode != BundleCycle) {
+		latency_add (usec);
+	} else if (latency_pending_count < 2 * queue_size) {
+		latency_pending[latency_pending_count++] = usec;
+	}
+}
+
+static void latency_flush (void) {
+	unsigned int i;
+	for (i = 0; i < latency_pending_count; ++i) {
+		latency_add (latency_pending[i]);
+	}
+	latency_pending_count = 0;
+}
+
+static void latency_report (const char *title, const Histogram *h) {
+	unsigned int i, b;
+	unsigned long oct[33];
+	printf ("\nLatency, %s. %lu events\n", title, h->count);
+	if (h->count == 0) {
+		return;
+	}
+	printf ("  avg: %.1f us, max: %u us, p50: %u us, p99: %u us, p99.9: %u us\n",
+			h->sum / (double) h->count, h->max,
+			hist_quantile (h, .5), hist_quantile (h, .99), hist_quantile (h, .999));
+
+	/* log2 summary */
+	memset (oct, 0, sizeof (oct));
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		const uint32_t v = hist_value (i);
+		b = 0;
+		while (b < 32 && (v >> b) > 0) {
+			++b;
+		}
+		oct[b] += h->bucket[i];
+	}
+	for (b = 0; b < 33; ++b) {
+		if (oct[b] == 0) {
+			continue;
+		}
+		printf ("  %10.0f .. %10.0f us: %8lu (%5.1f%%)\n",
+				b > 0 ? ldexp (1, b - 1) : 0, ldexp (1, b) - 1,
+				oct[b], 100.0 * oct[b] / h->count);
+	}
+}
+
+/******************************************************************************
+ * Statistics
+ *
+ * The main thread takes a snapshot of all counters, which is written
+ * as JSON by a helper thread, so file I/O does not delay dispatching
+ * events. A request is skipped while the previous one is still being
+ * written. Counters of other threads are read with STAT_GET.
+ */
+
+typedef struct {
+	const char   *name;
+	unsigned long messages;
+	unsigned long sent;
+	unsigned long syscalls;
+	unsigned long errors;
+	unsigned long dropped;
+	unsigned int  queue_hwm;
+	unsigned long reconnects;
+} StatsDest;
+
+typedef struct {
+	double         uptime;
+	double         rate;     // events/s since the previous snapshot
+	unsigned long  rx_events;
+	int            dropped;
+	int            coalesced;
+	unsigned long  sysex_dropped;
+	unsigned long  sysex_oversize;
+	unsigned long  late;
+	unsigned int   queue_used;
+	unsigned int   queue_hwm;
+	unsigned long  overflow_cycles;
+	int            latency;
+	Histogram      latency_dequeue;
+	Histogram      latency_send;
+	int            rule_count;
+	const char   **rule_port;
+	unsigned long *rule_hits;
+	unsigned int   dest_count;
+	StatsDest     *dests;
+	int            journal;
+	unsigned long  journal_bytes;
+	unsigned long  journal_size;
+	unsigned long  journal_dropped;
+	int            feedback;
+	unsigned long  fb_received;
+	unsigned long  fb_dropped;
+	unsigned long  tx_messages;
+	unsigned long  tx_packets;
+} StatsSnapshot;
+
+static jack_time_t   stats_start = 0;
+static jack_time_t   stats_next  = 0;
+static jack_time_t   stats_prev  = 0;
+static unsigned long stats_prev_events = 0;
+
+static void json_string (FILE *f, const char *s) {
+	fputc ('"', f);
+	for (; s && *s; ++s) {
+		if (*s == '"' || *s == '\\') {
+			fprintf (f, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf (f, "\\u%04x", *s);
+		} else {
+			fputc (*s, f);
+		}
+	}
+	fputc ('"', f);
+}
+
+static void json_histogram (FILE *f, const char *name, const Histogram *h) {
+	fprintf (f, "\"%s\": {\"count\": %lu, \"avg\": %.1f, \"max\": %u, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u}",
+			name, h->count, h->count > 0 ? h->sum / (double) h->count : 0, h->max,
+			hist_quantile (h, .5), hist_quantile (h, .9), hist_quantile (h, .99), hist_quantile (h, .999));
+}
+
+static void stats_free (StatsSnapshot *st) {
+	if (!st) {
+		return;
+	}
+	free (st->rule_port);
+	free (st->rule_hits);
+	free (st->dests);
+	free (st);
+}
+
+/* called from the main thread */
+static StatsSnapshot *stats_snapshot (void) {
+	unsigned int i;
+	int j;
+	StatsSnapshot *st = (StatsSnapshot*) calloc (1, sizeof (StatsSnapshot));
+	if (!st) {
+		return NULL;
+	}
+	st->rule_port = (const char**) malloc ((ruleset.rule_count + 1) * sizeof (const char*));
+	st->rule_hits = (unsigned long*) malloc ((ruleset.rule_count + 1) * sizeof (unsigned long));
+	st->dests     = (StatsDest*) calloc (dest_count + 1, sizeof (StatsDest));
+	if (!st->rule_port || !st->rule_hits || !st->dests) {
+		stats_free (st);
 		return NULL;
 	}
 
-	Rule *r = &rules[rc];
-	memset(r, 0, sizeof(Rule));
+	const jack_time_t now = clock_usec ();
+	const double dt = stats_prev > 0 ? (now - stats_prev) * 1e-6 : (now - stats_start) * 1e-6;
+
+	st->uptime          = (now - stats_start) * 1e-6;
+	st->rate            = dt > 0 ? (rx_events - stats_prev_events) / dt : 0;
+	st->rx_events       = rx_events;
+	st->dropped         = STAT_GET (dropped_messages);
+	st->coalesced       = STAT_GET (coalesced_messages);
+	st->sysex_dropped   = sysex_dropped;
+	st->sysex_oversize  = STAT_GET (sysex_oversize);
+	st->late            = late_events;
+	st->queue_used      = jack_ringbuffer_read_space (rb) / sizeof (MidiMessage);
+	st->queue_hwm       = STAT_GET (queue_hwm);
+	st->overflow_cycles = STAT_GET (overflow_cycles);
+
+	st->latency = want_latency;
+	if (want_latency) {
+		st->latency_dequeue = latency_dequeue;
+		st->latency_send    = latency_send;
+	}
+
+	st->rule_count = ruleset.rule_count;
+	for (j = 0; j < ruleset.rule_count; ++j) {
+		st->rule_port[j] = ports[ruleset.rules[j].port].name;
+		st->rule_hits[j] = ruleset.rules[j].hits;
+	}
+
+	st->dest_count = dest_count;
+	for (i = 0; i < dest_count; ++i) {
+		OSCDest *d = &dests[i];
+		StatsDest *sd = &st->dests[i];
+		sd->name       = d->name ? d->name : "default";
+		sd->messages   = d->messages;
+		sd->sent       = STAT_GET (d->sent);
+		sd->syscalls   = STAT_GET (d->syscalls);
+		sd->errors     = STAT_GET (d->errors);
+		sd->dropped    = d->txq_dropped;
+		sd->queue_hwm  = d->txq_hwm;
+		sd->reconnects = STAT_GET (d->reconnects);
+	}
+
+	st->journal = journal != NULL;
+	st->journal_bytes   = journal_pos;
+	st->journal_size    = journal_size;
+	st->journal_dropped = journal_dropped;
+
+	st->feedback    = feedback_count > 0;
+	st->fb_received = STAT_GET (fb_received);
+	st->fb_dropped  = STAT_GET (fb_dropped);
+
+	st->tx_messages = tx_messages;
+	st->tx_packets  = tx_packets;
+
+	stats_prev = now;
+	stats_prev_events = rx_events;
+	return st;
+}
+
+/* write statistics as JSON, to stdout or atomically replace `stats_file` */
+static void stats_write (const StatsSnapshot *st) {
+	unsigned int i;
+	int j;
+	FILE *f = stdout;
+	char *tmp = NULL;
+
+	if (stats_file) {
+		tmp = (char*) malloc (strlen (stats_file) + 5);
+		sprintf (tmp, "%s.tmp", stats_file);
+		if (!(f = fopen (tmp, "w"))) {
+			fprintf (stderr, "Cannot write statistics to '%s'.\n", tmp);
+			free (tmp);
+			return;
+		}
+	}
+
+	fprintf (f, "{\"uptime\": %.3f,\n", st->uptime);
+	fprintf (f, " \"events\": {\"received\": %lu, \"rate\": %.1f, \"dropped\": %d, \"coalesced\": %d, \"sysex_dropped\": %lu, \"sysex_oversize\": %lu, \"late\": %lu},\n",
+			st->rx_events, st->rate, st->dropped, st->coalesced, st->sysex_dropped, st->sysex_oversize, st->late);
+	fprintf (f, " \"queue\": {\"size\": %u, \"used\": %u, \"hwm\": %u, \"overflow_cycles\": %lu},\n",
+			queue_size, st->queue_used, st->queue_hwm, st->overflow_cycles);
+	if (st->latency) {
+		fprintf (f, " \"latency\": {");
+		json_histogram (f, "dequeue", &st->latency_dequeue);
+		fprintf (f, ", ");
+		json_histogram (f, "send", &st->latency_send);
+		fprintf (f, "},\n");
+	}
+
+	fprintf (f, " \"rules\": [");
+	for (j = 0; j < st->rule_count; ++j) {
+		fprintf (f, "%s\n  {\"rule\": %d, \"port\": ", j > 0 ? "," : "", j);
+		json_string (f, st->rule_port[j]);
+		fprintf (f, ", \"hits\": %lu}", st->rule_hits[j]);
+	}
+	fprintf (f, "],\n");
+
+	fprintf (f, " \"dests\": [");
+	for (i = 0; i < st->dest_count; ++i) {
+		const StatsDest *d = &st->dests[i];
+		fprintf (f, "%s\n  {\"name\": ", i > 0 ? "," : "");
+		json_string (f, d->name);
+		fprintf (f, ", \"messages\": %lu, \"packets\": %lu, \"syscalls\": %lu, \"errors\": %lu, \"dropped\": %lu, \"queue_hwm\": %u, \"reconnects\": %lu}",
+				d->messages, d->sent, d->syscalls, d->errors, d->dropped, d->queue_hwm, d->reconnects);
+	}
+	fprintf (f, "],\n");
+
+	if (st->journal) {
+		fprintf (f, " \"journal\": {\"bytes\": %lu, \"size\": %lu, \"dropped\": %lu},\n",
+				st->journal_bytes, st->journal_size, st->journal_dropped);
+	}
+
+	if (st->feedback) {
+		fprintf (f, " \"feedback\": {\"received\": %lu, \"dropped\": %lu},\n", st->fb_received, st->fb_dropped);
+	}
+
+	fprintf (f, " \"osc\": {\"messages\": %lu, \"packets\": %lu}}\n", st->tx_messages, st->tx_packets);
+
+	if (!stats_file) {
+		fflush (f);
+		return;
+	}
+
+	fclose (f);
+#ifdef _WIN32
+	remove (stats_file);
+#endif
+	if (rename (tmp, stats_file)) {
+		fprintf (stderr, "Cannot write statistics to '%s'.\n", stats_file);
+	}
+	free (tmp);
+}
+
+#ifndef WIN32
+static void *stats_writer (void *arg) {
+	StatsSnapshot *st = (StatsSnapshot*) arg;
+	stats_write (st);
+	stats_free (st);
+	STAT_SET (stats_done, 1);
+	return NULL;
+}
+
+static void stats_join (void) {
+	if (stats_running) {
+		pthread_join (stats_thread, NULL);
+		stats_running = 0;
+		stats_done = 0;
+	}
+}
+#endif
+
+/* called from the main thread, on request or interval */
+static void stats_request_write (void) {
+	StatsSnapshot *st;
+#ifndef WIN32
+	if (stats_running && !STAT_GET (stats_done)) {
+		return; // previous snapshot is still being written
+	}
+	stats_join ();
+#endif
+	if (!(st = stats_snapshot ())) {
+		fprintf (stderr, "Out of memory for statistics.\n");
+		return;
+	}
+#ifndef WIN32
+	if (!pthread_create (&stats_thread, NULL, stats_writer, st)) {
+		stats_running = 1;
+		return;
+	}
+	fprintf (stderr, "Cannot start statistics thread.\n");
+#endif
+	stats_write (st);
+	stats_free (st);
+}
+
+/******************************************************************************
+ * Event batch and coalescing
+ *
+ * Events that are ready to be sent are collected in a batch, which is
+ * dispatched at the end of the JACK cycle, or after the coalesce window.
+ * Rules that have coalescing enabled only fire for the last CC,
+ * pitch-bend or pressure value per channel/controller in the batch.
+ */
+
+static int batch_alloc (unsigned int size) {
+	batch = (MidiMessage*) calloc (size, sizeof (MidiMessage));
+	if (!batch) {
+		fprintf (stderr, "Cannot allocate event batch.\n");
+		return -1;
+	}
+	batch_size = size;
+	return 0;
+}
+
+/* key for last-value-wins: status-byte and controller/key if applicable */
+static inline int coalesce_key (const MidiMessage *m) {
+	const int port = m->port << 15;
+	switch (m->d[0] & 0xf0) {
+		case 0xa0:
+		case 0xb0:
+			return m->len == 3 ? port | (m->d[0] << 7) | (m->d[1] & 0x7f) : -1;
+		case 0xd0:
+			return m->len == 2 ? port | (m->d[0] << 7) : -1;
+		case 0xe0:
+			return m->len == 3 ? port | (m->d[0] << 7) : -1;
+		case STATUS_CC14:
+			return port | (m->d[0] << 7) | (m->d[1] & 0x7f);
+		default:
+			return -1;
+	}
+}
+
+static void batch_dispatch (void) {
+	unsigned int i;
+	int k;
+
+	if (ruleset.coalesce_rules > 0) {
+		/* mark events that are superseded by a later one with the same key */
+		for (i = batch_len; i > 0; --i) {
+			const int key = coalesce_key (&batch[i - 1]);
+			batch_superseded[i - 1] = 0;
+			if (key < 0) {
+				continue;
+			}
+			if (coalesce_seen[key >> 3] & (1 << (key & 7))) {
+				batch_superseded[i - 1] = 1;
+			} else {
+				coalesce_seen[key >> 3] |= 1 << (key & 7);
+			}
+		}
+		for (i = 0; i < batch_len; ++i) {
+			if ((k = coalesce_key (&batch[i])) >= 0) {
+				coalesce_seen[k >> 3] = 0;
+			}
+		}
+	}
+
+	if (sync_mode == SyncTimetag) {
+		update_jack_ntp_offset ();
+	}
+
+	for (i = 0; i < batch_len; ++i) {
+		if (sync_mode == SyncTimetag) {
+			lo_timetag tt;
+			frames_to_timetag (batch[i].tme, &tt);
+			osc_set_timetag (&tt);
+		}
+
+		dispatch (&batch[i], ruleset.coalesce_rules > 0 && batch_superseded[i]);
+
+		if (want_latency && batch[i].d[0] >= 0x80) {
+			latency_event (batch[i].usec);
+		}
+
+		if (batch[i].len > 3) {
+			sysex_release (&batch[i]);
+		}
+	}
+	batch_len = 0;
+}
+
+static void batch_push (const MidiMessage *m) {
+	if (batch_len == batch_size) {
+		batch_dispatch ();
+	}
+	if (batch_len == 0) {
+		batch_start = frame_time ();
+	}
+	batch[batch_len++] = *m;
+}
+
+/******************************************************************************
+ * CC decoder
+ *
+ * Pairs 14bit CCs (MSB 0..31, LSB 32..63) and assembles NRPN/RPN
+ * parameter changes (CC 99/98 or 101/100, data entry CC 6/38).
+ * A decoded message is added to the batch after the LSB that
+ * completes it. The original CC messages are dispatched as well.
+ */
+
+static int decoder_alloc (void) {
+	decoder = (DecoderState*) calloc (port_count * 16, sizeof (DecoderState));
+	if (!decoder) {
+		fprintf (stderr, "Cannot allocate CC decoder.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void decoder_emit (const MidiMessage *m, const uint8_t status, const uint8_t d1, const uint8_t d2, const uint32_t value) {
+	MidiMessage dm = *m;
+	dm.d[0]  = status | (m->d[0] & 0x0f);
+	dm.d[1]  = d1;
+	dm.d[2]  = d2;
+	dm.value = value;
+	batch_push (&dm);
+}
 
-	char *tmp, *fre, *prt;
-	int param[2];
-	int i = 0;
+/* switching between NRPN and RPN starts a new parameter selection */
+static inline void decoder_select (DecoderState *ds, const uint8_t selected) {
+	if (ds->selected != selected) {
+		ds->selected = selected;
+		ds->param[0] = ds->param[1] = 0;
+		ds->data_msb = 0;
+	}
+}
 
-	tmp = fre = strdup(flt);
-	for (prt = strtok(tmp, " "); prt; prt = strtok(NULL, " "), ++i) {
-		if (i >= 3) {
-			i = -1;
+/* (N)RPN data entry: the MSB (CC 6) sends the coarse value,
+ * a following LSB (CC 38) updates it to the full 14bit value */
+static void decode_cc (const MidiMessage *m) {
+	DecoderState *ds = &decoder[m->port * 16 + (m->d[0] & 0x0f)];
+	const uint8_t cc  = m->d[1] & 0x7f;
+	const uint8_t val = m->d[2] & 0x7f;
+
+	switch (cc) {
+		case 99:
+		case 98:
+			decoder_select (ds, STATUS_NRPN);
+			ds->param[cc == 99 ? 0 : 1] = val;
+			return;
+		case 101:
+		case 100:
+			decoder_select (ds, STATUS_RPN);
+			ds->param[cc == 101 ? 0 : 1] = val;
+			if (ds->param[0] == 127 && ds->param[1] == 127) {
+				decoder_select (ds, 0); // RPN null
+			}
+			return;
+		case 6:
+			if (ds->selected) {
+				ds->data_msb = val;
+				decoder_emit (m, ds->selected, ds->param[0], ds->param[1], scale_up (val << 7, 14));
+				return;
+			}
 			break;
-		}
-		if (!strcasecmp(prt, "ANY")) {
-			r->mask[i] = 0x00; r->match[i] = 0x00;
-		} else if (i == 0 && !strcasecmp(prt, "NOTE")) {
-			r->mask[i] = 0xe0; r->match[i] = 0x80;
-		} else if (i == 0 && !strcasecmp(prt, "NOTEOFF")) {
-			r->mask[i] = 0xf0; r->match[i] = 0x80;
-		} else if (i == 0 && !strcasecmp(prt, "NOTEON")) {
-			r->mask[i] = 0xf0; r->match[i] = 0x90;
-		} else if (i == 0 && !strcasecmp(prt, "KeyPressure")) {
-			r->mask[i] = 0xf0; r->match[i] = 0xa0; // Aftertouch, 3 bytes
-		} else if (i == 0 && !strcasecmp(prt, "CC")) {
-			r->mask[i] = 0xf0; r->match[i] = 0xb0;
-		} else if (i == 0 && !strcasecmp(prt, "PGM")) {
-			r->mask[i] = 0xf0; r->match[i] = 0xc0;
-		} else if (i == 0 && !strcasecmp(prt, "ChanPressure")) {
-			r->mask[i] = 0xf0; r->match[i] = 0xd0; // Aftertouch, 2 bytes
-		} else if (i == 0 && !strcasecmp(prt, "Pitch")) {
-			r->mask[i] = 0xf0; r->match[i] = 0xe0;
-		} else if (i == 0 && !strcasecmp(prt, "Pos")) {
-			r->mask[i] = 0xff; r->match[i] = 0xf2; // Song Position Pointer, 3 bytes
-		} else if (i == 0 && !strcasecmp(prt, "Song")) {
-			r->mask[i] = 0xff; r->match[i] = 0xf3; // Song select 2 bytes
-		} else if (i == 0 && !strcasecmp(prt, "Start")) {
-			r->mask[i] = 0xff; r->match[i] = 0xfa; // rt 1 byte
-		} else if (i == 0 && !strcasecmp(prt, "Cont")) {
-			r->mask[i] = 0xff; r->match[i] = 0xfb; // rt 1 byte
-		} else if (i == 0 && !strcasecmp(prt, "Stop")) {
-			r->mask[i] = 0xff; r->match[i] = 0xfc; // rt 1 byte
-		} else if (2 == sscanf (prt, "%i/%i", &param[0], &param[1])) {
-			r->mask[i] = param[1] & 0xff;
-			r->match[i] = param[0] & 0xff;
-		} else if (1 == sscanf (prt, "%i", &param[0])) {
-			r->mask[i] = (i == 0) ? 0xff : 0x7f;
-			r->match[i] = param[0] & 0xff;
-		} else {
-			fprintf(stderr, "Failed to parse rule filter\n");
-			i = -1;
+		case 38:
+			if (ds->selected) {
+				decoder_emit (m, ds->selected, ds->param[0], ds->param[1], scale_up ((ds->data_msb << 7) | val, 14));
+				return;
+			}
+			break;
+		default:
 			break;
+	}
+
+	if (cc < 32) {
+		ds->cc_msb[cc] = val;
+	} else if (cc < 64) {
+		decoder_emit (m, STATUS_CC14, cc - 32, 0, scale_up ((ds->cc_msb[cc - 32] << 7) | val, 14));
+	}
+}
+
+static void batch_add (const MidiMessage *m) {
+	batch_push (m);
+	if (ruleset.decoded_rules > 0 && (m->d[0] & 0xf0) == 0xb0 && m->len == 3) {
+		decode_cc (m);
+	}
+}
+
+/******************************************************************************
+ * OSC to MIDI feedback
+ *
+ * Incoming OSC messages are handled by liblo's server thread. Matching
+ * feedback rules format MIDI messages, which are passed to the
+ * process-callback using a lock-free ringbuffer and written to the
+ * MIDI output port.
+ */
+
+/* Integer arguments are used as-is, floats and doubles are
+ * normalized (0..1 maps to 0..max), booleans map to 0, max.
+ */
+static int32_t feedback_arg (const char type, const lo_arg *a, const int32_t max) {
+	double val;
+	switch (type) {
+		case LO_INT32:  val = a->i; break;
+		case LO_INT64:  val = a->h; break;
+		case LO_FLOAT:  val = rint (a->f * max); break;
+		case LO_DOUBLE: val = rint (a->d * max); break;
+		case LO_TRUE:   val = max; break;
+		default:        val = 0; break;
+	}
+	if (val < 0) {
+		return 0;
+	}
+	return val > max ? max : val;
+}
+
+static int feedback_handler (const char *path, const char *types, lo_arg **argv, int argc, lo_message msg, void *user_data) {
+	const FeedbackRule *fr = (const FeedbackRule*) user_data;
+	FeedbackEvent fe;
+	unsigned int i;
+
+	STAT_INC (fb_received);
+	fe.len = fr->len;
+	for (i = 0; i < fr->len; ++i) {
+		const FeedbackByte *fb = &fr->b[i];
+		if (fb->mode == FbConst) {
+			fe.d[i] = fb->base;
+			continue;
 		}
+		if (fb->arg >= argc) {
+			return 1;
+		}
+		if (i == 0) {
+			/* status byte, argument is the MIDI channel */
+			fe.d[0] = (fb->base + feedback_arg (types[fb->arg], argv[fb->arg], 15)) & 0xff;
+			continue;
+		}
+		int32_t val = feedback_arg (types[fb->arg], argv[fb->arg], fb->mode == FbArg ? 127 : 16383);
+		if (fb->mode == FbArgLSB) {
+			val &= 0x7f;
+		} else if (fb->mode == FbArgMSB) {
+			val >>= 7;
+		}
+		val += fb->base;
+		fe.d[i] = val > 127 ? 127 : val;
 	}
-	free (fre);
-	if (i < 1 || i > 3) {
-		fprintf(stderr, "Invalid filter rule...\n");
-		--rule_count;
-		return NULL;
+
+	if (jack_ringbuffer_write_space (fb_rb) < sizeof (FeedbackEvent)) {
+		STAT_INC (fb_dropped);
+	} else {
+		jack_ringbuffer_write (fb_rb, (const char*) &fe, sizeof (FeedbackEvent));
 	}
-	// TODO sanity check  message-type, len
-	r->len = i; // TODO allow 'len=0' catch all
-	return r;
+	return 1; // other rules may match the same message
 }
 
-static int parse_osc_addr (const char *arg) {
-	char addr[1024];
-	char port[64];
-	if (2 == sscanf (arg, "%[^:]:%[^:]", addr, port)) {
-		if (osc_dest) { lo_address_free (osc_dest); }
-		osc_dest = lo_address_new (addr, port);
-	} else if (atoi (arg) > 0 && atoi (arg) < 65536) {
-		if (osc_dest) { lo_address_free (osc_dest); }
-		snprintf (port, sizeof (port), "%d", atoi (arg));
-		osc_dest = lo_address_new (NULL, port);
+static void feedback_error (int num, const char *msg, const char *where) {
+	fprintf (stderr, "OSC server error %d: %s (%s)\n", num, msg, where ? where : "");
+}
+
+static int feedback_start (void) {
+	unsigned int i;
+	if (feedback_count == 0) {
+		return 0;
+	}
+	if (!listen_url) {
+		fprintf (stderr, "Feedback rules require an OSC server port ('listen' option).\n");
+		return -1;
+	}
+
+	if (!(fb_rb = jack_ringbuffer_create (FEEDBACK_QUEUE * sizeof (FeedbackEvent)))) {
+		fprintf (stderr, "Cannot allocate feedback ringbuffer.\n");
+		return -1;
+	}
+
+	if (strstr (listen_url, "://")) {
+		fb_server = lo_server_thread_new_from_url (listen_url, feedback_error);
 	} else {
-		fprintf (stderr, "given OSC address '%s' is not valid\n\n", arg);
+		fb_server = lo_server_thread_new (listen_url, feedback_error);
+	}
+	if (!fb_server) {
+		fprintf (stderr, "Cannot start OSC server on '%s'.\n", listen_url);
+		return -1;
+	}
+
+	for (i = 0; i < feedback_count; ++i) {
+		lo_server_thread_add_method (fb_server, feedback[i].path, feedback[i].types, feedback_handler, &feedback[i]);
+	}
+
+	if (lo_server_thread_start (fb_server)) {
+		fprintf (stderr, "Cannot start OSC server thread.\n");
 		return -1;
 	}
 	return 0;
 }
 
-static int parse_sync_mode (const char *arg) {
-	if (!arg || strlen(arg) < 1) { return -1; }
-	size_t cl = strlen(arg);
-	if      (!strncasecmp(arg, "Immediate", cl)) { sync_mode = SyncImmediate; }
-	else if (!strncasecmp(arg, "Absolute", cl))  { sync_mode = SyncAbsolute; }
-	else if (!strncasecmp(arg, "Relative", cl))  { sync_mode = SyncRelative; }
-	else { return -1; }
-	return 0;
+/******************************************************************************
+ * Config reload
+ *
+ * Rules are re-read from the same config file(s) as on startup.
+ * Parsing happens in a separate thread, while events continue to be
+ * processed with the current rules. The new rule-set is swapped in by
+ * the main thread once the current batch has been dispatched.
+ */
+
+#ifndef WIN32
+static void *rules_reload (void *arg) {
+	RuleSet *rs = (RuleSet*) calloc (1, sizeof (RuleSet));
+	if (!rs) {
+		fprintf (stderr, "Out of memory for rule(s).\n");
+		goto done;
+	}
+	if (load_rules (rs) || state_alloc (rs)) {
+		goto fail;
+	}
+	reload_rules = rs;
+	goto done;
+
+fail:
+	ruleset_free (rs);
+	free (rs);
+done:
+	reload_done = 1;
+	wakeup_signal (&main_wakeup);
+	return NULL;
 }
 
-static int read_config (const char *configfile) {
-	FILE *f;
-	char line[MAX_CFG_LINE_LEN];
+static void rules_reload_start (void) {
+	reload_request = 0;
+	reload_done = 0;
+	if (pthread_create (&reload_thread, NULL, rules_reload, NULL)) {
+		fprintf (stderr, "Cannot start config reload thread.\n");
+		return;
+	}
+	reload_running = 1;
+}
 
-	if (!(f = fopen(configfile, "r"))) {
-		fprintf (stderr, "Cannot open config '%s' for reading.\n", configfile);
-		return -1;
-	} else {
-		printf ("Reading config '%s'\n", configfile);
+/* called from the main thread in-between event batches */
+static void rules_reload_swap (void) {
+	pthread_join (reload_thread, NULL);
+	reload_running = 0;
+	reload_done = 0;
+
+	if (!reload_rules) {
+		fprintf (stderr, "Config reload failed, keeping previous rules.\n");
+		return;
 	}
 
-	int rv = 0;
-	int lineno = 0;
-	Rule *r = NULL;
-	enum {NoRule, StartRule, InRule, InConfig} parser_state = NoRule;
+	ruleset_free (&ruleset);
+	ruleset = *reload_rules;
+	free (reload_rules);
+	reload_rules = NULL;
 
-	// read file line by line
-	while (fgets (line, MAX_CFG_LINE_LEN - 1, f) != NULL ) {
-		++lineno;
+	coalesce_frames = ruleset.coalesce_rules > 0 ? ceil (coalesce_ms * samplerate / 1000.0) : 0;
 
-		if (strlen(line) == MAX_CFG_LINE_LEN - 1) {
-			fprintf (stderr, "Too long line: %d\n", lineno);
-			continue;
+	printf ("Reloaded config: %d rules, rule index: %d entries\n", ruleset.rule_count, ruleset.index_size);
+	if (want_verbose > 1) {
+		dump_cfg (&ruleset);
+	}
+}
+#endif
+
+/******************************************************************************
+ * Capture journal
+ *
+ * Events are appended to a preallocated, memory-mapped file by the main
+ * thread as they are read from the queue, using the event log format
+ * (see --replay). Writing is a memcpy; the kernel writes dirty pages
+ * back asynchronously, msync(MS_ASYNC) is only issued every JOURNAL_SYNC
+ * bytes. Once the journal is full, further events are not recorded.
+ * A previous, non-empty journal is kept as '<file>.N'.
+ */
+
+#ifndef _WIN32
+/* move an existing capture to the first unused '<file>.N' */
+static int journal_rotate (void) {
+	struct stat st;
+	unsigned int i;
+	int rv = -1;
+
+	if (stat (journal_file, &st) || st.st_size == 0) {
+		return 0;
+	}
+	char *fn = (char*) malloc (strlen (journal_file) + 12);
+	for (i = 1; i < 10000; ++i) {
+		sprintf (fn, "%s.%u", journal_file, i);
+		if (stat (fn, &st) && errno == ENOENT) {
+			break;
 		}
-		
-		while (strlen(line) > 0 && (line[strlen(line) - 1] == '\n' || line[strlen(line) - 1] == '\r' || line[strlen(line) - 1] == ' ' || line[strlen(line) - 1] == '\t')) {
-			line[strlen(line) - 1] = '\0';
+	}
+	if (i == 10000 || rename (journal_file, fn)) {
+		fprintf (stderr, "Cannot move previous journal '%s' out of the way.\n", journal_file);
+	} else {
+		printf ("Previous journal moved to '%s'\n", fn);
+		rv = 0;
+	}
+	free (fn);
+	return rv;
+}
+#endif
+
+static int journal_open (void) {
+#ifdef _WIN32
+	fprintf (stderr, "Capture journal is not supported on this platform.\n");
+	return -1;
+#else
+	EventLogHeader h;
+	int err;
+	journal_size = (size_t) journal_mb << 20;
+
+	if (journal_rotate ()) {
+		return -1;
+	}
+	if ((journal_fd = open (journal_file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf (stderr, "Cannot open journal '%s': %s\n", journal_file, strerror (errno));
+		return -1;
+	}
+	/* allocate all blocks now, rather than failing with SIGBUS while recording */
+	if ((err = posix_fallocate (journal_fd, 0, journal_size))) {
+		fprintf (stderr, "Cannot allocate journal '%s': %s\n", journal_file, strerror (err));
+		return -1;
+	}
+	journal = (uint8_t*) mmap (NULL, journal_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal_fd, 0);
+	if (journal == MAP_FAILED) {
+		journal = NULL;
+		fprintf (stderr, "Cannot map journal '%s': %s\n", journal_file, strerror (errno));
+		return -1;
+	}
+
+	memset (&h, 0, sizeof (EventLogHeader));
+	memcpy (h.magic, EVLOG_MAGIC, 8);
+	h.version = EVLOG_VERSION;
+	h.samplerate = samplerate;
+	memcpy (journal, &h, sizeof (EventLogHeader));
+	journal_pos = journal_synced = sizeof (EventLogHeader);
+	return 0;
+#endif
+}
+
+#ifndef _WIN32
+static void journal_sync (const int flags) {
+	const size_t page = sysconf (_SC_PAGESIZE);
+	const size_t from = journal_synced & ~(page - 1);
+	msync (&journal[from], journal_pos - from, flags);
+	journal_synced = journal_pos;
+}
+#endif
+
+static inline void journal_write (const MidiMessage *m) {
+	const size_t rs = sizeof (MidiMessage) + (m->len > 3 ? m->len : 0);
+	if (journal_pos + rs > journal_size) {
+		++journal_dropped;
+		return;
+	}
+	memcpy (&journal[journal_pos], m, sizeof (MidiMessage));
+	if (m->len > 3) {
+		memcpy (&journal[journal_pos + sizeof (MidiMessage)], midi_data (m), m->len);
+	}
+	journal_pos += rs;
+#ifndef _WIN32
+	if (journal_pos - journal_synced >= JOURNAL_SYNC) {
+		journal_sync (MS_ASYNC);
+	}
+#endif
+}
+
+/* flush and truncate the file to the recorded size */
+static void journal_close (void) {
+#ifndef _WIN32
+	if (journal) {
+		journal_sync (MS_SYNC);
+		munmap (journal, journal_size);
+		if (ftruncate (journal_fd, journal_pos)) {
+			fprintf (stderr, "Cannot truncate journal '%s'.\n", journal_file);
 		}
+	}
+	if (journal_fd >= 0) {
+		close (journal_fd);
+	}
+	journal_fd = -1;
+#endif
+	journal = NULL;
+}
+
+/******************************************************************************
+ * Event processing
+ */
 
-		if (strlen(line) == 0 || line[0] == '#') {
+/* read events from the queue, dispatch all that are due
+ * and flush OSC bundles. Called by the main loop and by replay.
+ */
+static void process_events (const jack_nframes_t deadzone) {
+	MidiMessage mmsg;
+	while (jack_ringbuffer_read_space (rb) >= sizeof (MidiMessage)) {
+		if (deadzone > 0 && sched_len == sched_size) {
+			break; // keep remaining events in the ringbuffer
+		}
+		if (!queue_read (&mmsg)) {
 			continue;
 		}
+		++rx_events;
+		if (journal) {
+			journal_write (&mmsg);
+		}
+		if (want_latency) {
+			latency_dequeue_event (&mmsg);
+		}
 
-		if (!strcmp (line, "[config]")) {
-			if (parser_state == StartRule) {
-				rv = -1;
-				goto parser_end;
+		if (want_verbose > 1) {
+			if (port_count > 1) {
+				printf ("(%s) ", ports[mmsg.port].name);
 			}
-			parser_state = InConfig;
-		}
-		else if (!strcmp (line, "[rule]")) {
-			if (parser_state == StartRule) {
-				rv = -1;
-				goto parser_end;
+			if (mmsg.len > 3) {
+				printf ("RX MIDI: [0x%02x 0x%02x 0x%02x .. %d bytes] @%"PRIu32"\n",
+						mmsg.d[0], mmsg.d[1], mmsg.d[2], mmsg.len, mmsg.tme);
+			} else {
+				printf ("RX MIDI: [0x%02x 0x%02x 0x%02x] @%"PRIu32"\n",
+						mmsg.d[0], mmsg.d[1], mmsg.d[2], mmsg.tme);
 			}
-			parser_state = StartRule;
 		}
-		else if (parser_state == InRule) {
-			assert (r);
-			// TODO split properly, check lengths, allow escaped quotes in path
-			char a[1024], b[16], c[1024];
-			if (3 == sscanf (line, "\"%[^\"]\" \"%[^\"]\" %1023c", a, b, c)) {
-				if (append_osc_message(r, a, b, c)) {
-					fprintf (stderr, "Failed to append/parse OSC message from line: %d\n", lineno);
-				}
-			} else
-			if (1 == sscanf (line, "\"%[^\"]\" \"\"", a)) {
-				if (append_osc_message(r, a, "", "")) {
-					fprintf (stderr, "Failed to append/parse OSC message from line: %d\n", lineno);
+
+		if (deadzone > 0) {
+			mmsg.tme += deadzone;
+			sched_push (&mmsg);
+			continue;
+		}
+
+		batch_add (&mmsg);
+	}
+
+	const jack_nframes_t now = frame_time ();
+
+	if (deadzone > 0) {
+		/* collect all events that are due */
+		while (sched_pop_due (now, &mmsg)) {
+			const jack_nframes_t late = now - mmsg.tme;
+			if (late > deadzone) {
+				++late_events;
+				if (late > late_max) {
+					late_max = late;
 				}
-			} else {
-				fprintf (stderr, "Invalid OSC message format. line: %d\n", lineno);
 			}
+			batch_add (&mmsg);
 		}
-		else if (parser_state == StartRule) {
-			r = new_rule (line);
-			if (r) {
-				parser_state = InRule;
-			} else {
-				parser_state = NoRule;
-			}
+	}
+
+	if (batch_len > 0 && (coalesce_frames == 0 || (int32_t)(now - batch_start) >= (int32_t)coalesce_frames)) {
+		batch_dispatch ();
+	}
+
+	if (bundle_mode == BundleCycle) {
+		osc_flush ();
+		if (want_latency) {
+			latency_flush ();
+		}
+	}
+}
+
+/******************************************************************************
+ * Replay
+ *
+ * Events are read from a Standard MIDI File or an event log and passed
+ * through the same queue and processing as events received from JACK.
+ * This allows to test and benchmark a configuration without JACK.
+ */
+
+/* SMF tempo change */
+typedef struct {
+	uint32_t tick;
+	uint32_t uspq; // microseconds per quarter note
+} SMFTempo;
+
+static Histogram     replay_hist; // processing time per event (nsec)
+
+static int replay_add (const MidiMessage *m, const uint8_t *data) {
+	if (replay_count % 1024 == 0) {
+		ReplayEvent *re = (ReplayEvent*) realloc (replay_events, (replay_count + 1024) * sizeof (ReplayEvent));
+		if (!re) {
+			return -1;
+		}
+		replay_events = re;
+	}
+	ReplayEvent *e = &replay_events[replay_count];
+	e->m = *m;
+	e->data = NULL;
+	if (m->len > 3) {
+		if (!(e->data = (uint8_t*) malloc (m->len))) {
+			return -1;
+		}
+		memcpy (e->data, data, m->len);
+		e->m.sysex = 0;
+	}
+	++replay_count;
+	return 0;
+}
+
+static int replay_add_midi (const uint8_t *d, const unsigned int len, const uint32_t tick) {
+	MidiMessage m;
+	memset (&m, 0, sizeof (MidiMessage));
+	m.tme  = tick;
+	m.usec = replay_count; // sequence, to keep the order of events with equal time
+	m.len  = len;
+	m.d[0] = d[0];
+	m.d[1] = len > 1 ? d[1] : 0;
+	m.d[2] = len > 2 ? d[2] : 0;
+	m.value = midi1_value (m.d, len);
+	return replay_add (&m, d);
+}
+
+static uint32_t smf_varlen (const uint8_t **p, const uint8_t *end) {
+	uint32_t val = 0;
+	while (*p < end) {
+		const uint8_t c = *(*p)++;
+		val = (val << 7) | (c & 0x7f);
+		if (!(c & 0x80)) {
+			break;
+		}
+	}
+	return val;
+}
+
+static inline uint32_t smf_be32 (const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int smf_cmp_event (const void *a, const void *b) {
+	const MidiMessage *ma = &((const ReplayEvent*)a)->m;
+	const MidiMessage *mb = &((const ReplayEvent*)b)->m;
+	if (ma->tme != mb->tme) {
+		return ma->tme < mb->tme ? -1 : 1;
+	}
+	return ma->usec < mb->usec ? -1 : (ma->usec > mb->usec);
+}
+
+static int smf_cmp_tempo (const void *a, const void *b) {
+	const SMFTempo *ta = (const SMFTempo*) a;
+	const SMFTempo *tb = (const SMFTempo*) b;
+	return ta->tick < tb->tick ? -1 : (ta->tick > tb->tick);
+}
+
+/* parse one track, events are added with their time in ticks */
+static int smf_read_track (const uint8_t *p, const uint8_t *end, SMFTempo **tempo, unsigned int *tempo_count) {
+	uint8_t sysex[MAX_SYSEX_SIZE];
+	uint32_t tick = 0;
+	uint8_t status = 0;
+
+	while (p < end) {
+		tick += smf_varlen (&p, end);
+		if (p >= end) {
+			break;
 		}
-		else if (parser_state == InConfig) {
-			if (!strncasecmp(line, "osc=", 4) && strlen(line) > 4) {
-				parse_osc_addr(line + 4);
+		const uint8_t c = *p;
+
+		if (c == 0xff) {
+			/* meta event */
+			if (end - p < 2) {
+				return -1;
 			}
-			else if (!strncasecmp(line, "input=", 6) && strlen(line) > 6) {
-				free (j_connect);
-				j_connect = strdup(line + 6);
+			const uint8_t type = p[1];
+			p += 2;
+			const uint32_t len = smf_varlen (&p, end);
+			if (len > end - p) {
+				return -1;
 			}
-			else if (!strncasecmp(line, "syncmode=", 9) && strlen(line) > 9) {
-				parse_sync_mode(line + 9);
+			if (type == 0x2f) {
+				break; // end of track
 			}
-		} else {
-			fprintf (stderr, "Ignored config line: %d\n", lineno);
+			if (type == 0x51 && len == 3) {
+				SMFTempo *t = (SMFTempo*) realloc (*tempo, (*tempo_count + 1) * sizeof (SMFTempo));
+				if (!t) {
+					return -1;
+				}
+				t[*tempo_count].tick = tick;
+				t[*tempo_count].uspq = (p[0] << 16) | (p[1] << 8) | p[2];
+				*tempo = t;
+				++*tempo_count;
+			}
+			p += len;
+			continue;
 		}
-	}
 
-parser_end:
-	if (rv) {
-		fprintf (stderr, "Failed to parse config, line %d\n", lineno);
-	}
+		if (c == 0xf0 || c == 0xf7) {
+			/* SysEx, 0xf7 escapes are ignored */
+			++p;
+			const uint32_t len = smf_varlen (&p, end);
+			if (len > end - p) {
+				return -1;
+			}
+			if (c == 0xf0 && len + 1 > MAX_SYSEX_SIZE) {
+				++sysex_oversize;
+			} else if (c == 0xf0 && len + 1 > 3) {
+				sysex[0] = 0xf0;
+				memcpy (&sysex[1], p, len);
+				if (replay_add_midi (sysex, len + 1, tick)) {
+					return -1;
+				}
+			}
+			p += len;
+			status = 0;
+			continue;
+		}
 
-	fclose(f);
-	return rv;
+		if (c & 0x80) {
+			if (c > 0xf0) {
+				return -1;
+			}
+			status = c;
+			++p;
+		} else if (status == 0) {
+			return -1; // running status without status
+		}
 
+		const unsigned int n = (status & 0xe0) == 0xc0 ? 1 : 2;
+		if (end - p < n) {
+			return -1;
+		}
+		const uint8_t d[3] = { status, p[0], n > 1 ? p[1] : 0 };
+		if (replay_add_midi (d, n + 1, tick)) {
+			return -1;
+		}
+		p += n;
+	}
 	return 0;
 }
 
-static void dump_cfg (void) {
-	int j;
-	printf("\n# ----- CFG DUMP -----\n");
-	printf("[config]\n");
-	if (osc_dest) {
-		printf("# OSC destination\n");
-		printf("osc=%s:%s\n\n",
-				lo_address_get_hostname(osc_dest),
-				lo_address_get_port(osc_dest));
-	}
-	if (j_connect) {
-		printf("# auto-connect to jack-midi capture port\n");
-		printf("input=%s\n\n", j_connect);
+/* Standard MIDI File, format 0 or 1. All tracks are merged, events
+ * are sent to the first input port.
+ */
+static int smf_read (const uint8_t *buf, const size_t size) {
+	SMFTempo *tempo = NULL;
+	unsigned int tempo_count = 0;
+	unsigned int i, t;
+	int rv = -1;
+
+	if (size < 14 || smf_be32 (&buf[4]) < 6) {
+		return -1;
 	}
-	printf("\n");
+	const uint16_t division = (buf[12] << 8) | buf[13];
+	size_t off = 8 + smf_be32 (&buf[4]);
 
-	for (j = 0; j < rule_count; ++j) {
-		int i;
-		Rule *r = &rules[j];
-		printf("# rule %d\n", j);
-		printf("[rule]\n0x%02x/0x%02x", r->match[0], r->mask[0]);
-		if (r->len > 1) {
-			printf(" 0x%02x/0x%02x", r->match[1], r->mask[1]);
+	while (off + 8 <= size) {
+		const uint32_t len = smf_be32 (&buf[off + 4]);
+		if (len > size - off - 8) {
+			break;
 		}
-		if (r->len > 2) {
-			printf(" 0x%02x/0x%02x", r->match[1], r->mask[1]);
+		if (!memcmp (&buf[off], "MTrk", 4) && smf_read_track (&buf[off + 8], &buf[off + 8 + len], &tempo, &tempo_count)) {
+			goto out;
 		}
-		printf("\n");
+		off += 8 + len;
+	}
 
-		const unsigned int mc = r->message_count;
-		for (i = 0; i < mc; ++i) {
-			int k;
-			const unsigned int pl = strlen (r->msg[i].desc);
+	if (replay_count > 1) {
+		qsort (replay_events, replay_count, sizeof (ReplayEvent), smf_cmp_event);
+	}
+	if (tempo_count > 1) {
+		qsort (tempo, tempo_count, sizeof (SMFTempo), smf_cmp_tempo);
+	}
 
-			printf("\"%s\" \"%s\"",
-					r->msg[i].path, r->msg[i].desc);
+	/* ticks to frames */
+	double sec_per_tick;
+	if (division & 0x8000) {
+		/* SMPTE: frames per second, ticks per frame */
+		sec_per_tick = 1.0 / (-(int8_t)(division >> 8) * (double)(division & 0xff));
+	} else {
+		sec_per_tick = 0.5 / (division > 0 ? division : 96); // 120 BPM
+	}
 
-			for (k = 0; k < pl; ++k) {
-				printf(" \"%s\"", r->msg[i].param[k]);
-			}
-			printf("\n");
+	double sec = 0;
+	uint32_t tick = 0;
+	for (i = 0, t = 0; i < replay_count; ++i) {
+		MidiMessage *m = &replay_events[i].m;
+		while (!(division & 0x8000) && t < tempo_count && tempo[t].tick <= m->tme) {
+			sec += (tempo[t].tick - tick) * sec_per_tick;
+			tick = tempo[t].tick;
+			sec_per_tick = tempo[t].uspq * 1e-6 / (division > 0 ? division : 96);
+			++t;
 		}
-		printf("\n");
+		m->tme = rint ((sec + (m->tme - tick) * sec_per_tick) * samplerate);
 	}
-	printf("# --------------------\n");
+	rv = 0;
+
+out:
+	free (tempo);
+	return rv;
 }
 
-/******************************************************************************
- * MIDI to OSC translation
- */
+static int evlog_read (const uint8_t *buf, const size_t size) {
+	EventLogHeader h;
+	MidiMessage m;
+	jack_nframes_t t0 = 0;
+	unsigned long skipped = 0;
 
-static int32_t expand_int32 (const char *tpl, MidiMessage *m) {
-	assert (tpl[0] != '\0');
-	if (tpl[0] != '%') {
-		return atoi (tpl);
-	}
-
-	char x;
-	int source[2];
-	int target[2];
-	if (5 == sscanf(tpl, "%%%c [%i,%i] [%i,%i]", &x, &target[0], &target[1], &source[0], &source[1])) {
-		;
-	} else if (3 == sscanf(tpl, "%%%c [%i,%i]", &x, &target[0], &target[1])) {
-		source[0] = 0;
-		source[1] = 0x7f;
-	} else if (1 == sscanf(tpl, "%%%c", &x)) {
-		source[0] = 0;
-		source[1] = 0x7f;
-		target[0] = 0;
-		target[1] = 0x7f;
-	} else {
-		fprintf (stderr, "Invalid expression: %s\n", tpl);
-		return 0;
+	memcpy (&h, buf, sizeof (EventLogHeader));
+	if (h.version != EVLOG_VERSION) {
+		fprintf (stderr, "Unsupported event log version %u.\n", h.version);
+		return -1;
 	}
-
-	if (source[0] >= source[1] || source[0] < 0 || source[1] > 0x7f) {
-		fprintf (stderr, "Invalid Range: %s\n", tpl);
-		return 0;
+	if (h.samplerate > 0) {
+		samplerate = h.samplerate;
 	}
 
-	int val;
-	switch (x) {
-		case '0':
-			val = m->d[0] & 0xff;
-			break;
-		case '1':
-			val = m->d[1] & 0x7f;
-			break;
-		case '2':
-			val = m->d[2] & 0x7f;
-			break;
-		case 'c':
-			val = m->d[0] & 0x0f;
-			// TODO use default src range 0..15
-			break;
-		case 's':
-			val = m->d[0] & 0xf0;
-			break;
-		default:
-			fprintf (stderr, "Invalid Placeholder: %s\n", tpl);
-			return 0.f;
+	size_t off = sizeof (EventLogHeader);
+	while (off + sizeof (MidiMessage) <= size) {
+		memcpy (&m, &buf[off], sizeof (MidiMessage));
+		off += sizeof (MidiMessage);
+		const uint8_t *data = &buf[off];
+		if (m.len == 0) {
 			break;
+		}
+		if (m.len > 3) {
+			if (m.len > MAX_SYSEX_SIZE || off + m.len > size) {
+				break;
+			}
+			off += m.len;
+		}
+		if (m.port >= port_count) {
+			++skipped;
+			continue;
+		}
+		if (replay_count == 0) {
+			t0 = m.tme;
+		}
+		m.tme -= t0;
+		if (replay_add (&m, data)) {
+			return -1;
+		}
 	}
-
-	if (val <= source[0]) return target[0];
-	if (val >= source[1]) return target[1];
-
-	return target[0] + (val - source[0]) * (target[1] - target[0]) / (target[1] - target[0]);
+	if (skipped > 0) {
+		fprintf (stderr, "Skipped %lu events of unknown input ports.\n", skipped);
+	}
+	return 0;
 }
 
-static float expand_float (const char *tpl, MidiMessage *m) {
-	assert (tpl[0] != '\0');
-	if (tpl[0] != '%') {
-		return atof (tpl);
-	}
+static int replay_load (const char *fn) {
+	FILE *f;
+	struct stat s;
+	int rv = -1;
 
-	char x;
-	int source[2];
-	float target[2];
-	if (5 == sscanf(tpl, "%%%c [%f,%f] [%i,%i]", &x, &target[0], &target[1], &source[0], &source[1])) {
-		;
-	} else if (3 == sscanf(tpl, "%%%c [%f,%f]", &x, &target[0], &target[1])) {
-		source[0] = 0;
-		source[1] = 0x7f;
-	} else if (1 == sscanf(tpl, "%%%c", &x)) {
-		source[0] = 0;
-		source[1] = 0x7f;
-		target[0] = 0.f;
-		target[1] = 127.f;
-	} else {
-		fprintf (stderr, "Invalid expression: %s\n", tpl);
-		return 0.f;
+	if (stat (fn, &s) || !(f = fopen (fn, "rb"))) {
+		fprintf (stderr, "Cannot open '%s'.\n", fn);
+		return -1;
 	}
 
-	if (source[0] >= source[1] || source[0] < 0 || source[1] > 0x7f) {
-		fprintf (stderr, "Invalid Range: %s\n", tpl);
-		return 0.f;
+	uint8_t *buf = (uint8_t*) malloc (s.st_size > 0 ? s.st_size : 1);
+	if (!buf || fread (buf, 1, s.st_size, f) != (size_t) s.st_size) {
+		fprintf (stderr, "Cannot read '%s'.\n", fn);
+		goto out;
 	}
 
-	float val;
-	switch (x) {
-		case '0':
-			val = m->d[0] & 0xff;
-			break;
-		case '1':
-			val = m->d[1] & 0x7f;
-			break;
-		case '2':
-			val = m->d[2] & 0x7f;
-			break;
-		case 'c':
-			val = m->d[0] & 0x0f;
-			break;
-		case 's':
-			val = m->d[0] & 0xf0;
-			break;
-		default:
-			fprintf (stderr, "Invalid Placeholder: %s\n", tpl);
-			return 0.f;
-			break;
+	if (s.st_size >= 4 && !memcmp (buf, "MThd", 4)) {
+		rv = smf_read (buf, s.st_size);
+	} else if (s.st_size >= sizeof (EventLogHeader) && !memcmp (buf, EVLOG_MAGIC, 8)) {
+		rv = evlog_read (buf, s.st_size);
+	} else {
+		fprintf (stderr, "'%s' is neither a MIDI file nor an event log.\n", fn);
+		goto out;
 	}
 
-	if (val <= source[0]) return target[0];
-	if (val >= source[1]) return target[1];
+	if (rv) {
+		fprintf (stderr, "Failed to parse '%s'.\n", fn);
+	} else if (replay_count == 0) {
+		fprintf (stderr, "No events in '%s'.\n", fn);
+		rv = -1;
+	}
 
-	return target[0] + (val - source[0]) * (target[1] - target[0]) / (float)(source[1] - source[0]);
+out:
+	free (buf);
+	fclose (f);
+	return rv;
 }
 
-static void expand_and_send (Rule *r, MidiMessage *m) {
-	unsigned int i,c;
-	const unsigned int mc = r->message_count;
+static void replay_inject (const ReplayEvent *e) {
+	const size_t rs = sizeof (MidiMessage) + (e->m.len > 3 ? e->m.len : 0);
+	if (jack_ringbuffer_write_space (rb) < rs) {
+		++dropped_messages;
+		return;
+	}
+	MidiMessage m = e->m;
+	m.usec = clock_usec ();
+	/* the main thread is the only reader, header and payload can be written separately */
+	jack_ringbuffer_write (rb, (const char*) &m, sizeof (MidiMessage));
+	if (m.len > 3) {
+		jack_ringbuffer_write (rb, (const char*) e->data, m.len);
+	}
+}
 
-	for (i = 0; i < mc; ++i) {
-		lo_message oscmsg = lo_message_new();
-		if (!oscmsg) {
-			fprintf (stderr, "Cannot allocate OSC Message.\n");
-			continue;
+/* realtime replay: wait until the given position, meanwhile process due events */
+static void replay_wait (const jack_nframes_t due, const jack_nframes_t deadzone) {
+	while (run != Terminate) {
+		replay_frames = (clock_usec () - replay_epoch) * samplerate / 1e6;
+		const int32_t dt = due - replay_frames;
+		if (dt <= 0) {
+			break;
 		}
+		process_events (deadzone);
+		const int64_t us = ceil (dt * 1e6 / samplerate);
+		wakeup_wait (&main_wakeup, us < 1000 ? us : 1000);
+	}
+}
 
-		int err = 0;
-		for (c = 0; c < strlen(r->msg[i].desc); ++c) {
-			switch (r->msg[i].desc[c]) {
-				case LO_INT32:
-					err |= lo_message_add_int32 (oscmsg, expand_int32 (r->msg[i].param[c], m));
-					break;
-				case LO_FLOAT:
-					err |= lo_message_add_float (oscmsg, expand_float (r->msg[i].param[c], m));
-					break;
-				case LO_STRING:
-					err |= lo_message_add_string (oscmsg, r->msg[i].param[c]);
-					break;
-				default:
-					fprintf(stderr, "Failed to expand OSC parameter '%c'.\n", r->msg[i].desc[c]);
-					err = 1;
-					break;
-			}
-		}
-		if (err != 0) {
-			fprintf(stderr, "Failed to construct OSC message\n");
-			lo_message_free (oscmsg);
-			continue;;
-		}
+static void replay_run (const jack_nframes_t deadzone) {
+	unsigned int i;
+	const uint64_t start = monotonic_nsec ();
+	replay_epoch = start / 1000;
 
-		if (want_verbose > 1) {
-			printf("TX: %s ", r->msg[i].path);
-			lo_message_pp(oscmsg);
+	printf ("Replaying %u events (%.1f sec)%s\n", replay_count,
+			replay_events[replay_count - 1].m.tme / samplerate, replay_realtime ? " in realtime" : "");
+
+	for (i = 0; i < replay_count && run != Terminate; ++i) {
+		const ReplayEvent *e = &replay_events[i];
+		if (replay_realtime) {
+			replay_wait (e->m.tme, deadzone);
+		} else {
+			replay_frames = e->m.tme;
 		}
+		const uint64_t t0 = monotonic_nsec ();
+		replay_inject (e);
+		process_events (deadzone);
+		const uint64_t dt = monotonic_nsec () - t0;
+		hist_add (&replay_hist, dt > UINT32_MAX ? UINT32_MAX : dt);
+	}
 
-		if (-1 == lo_send_message (osc_dest, r->msg[i].path, oscmsg)) {
-			fprintf(stderr, "Failed to send OSC message '%s'.\n", r->msg[i].path);
+	/* dispatch remaining scheduled and coalesced events */
+	while (run != Terminate && (sched_len > 0 || batch_len > 0 || jack_ringbuffer_read_space (rb) > 0)) {
+		const jack_nframes_t due = replay_frames + deadzone + coalesce_frames + 1;
+		if (replay_realtime) {
+			replay_wait (due, deadzone);
+		} else {
+			replay_frames = due;
 		}
-		lo_message_free (oscmsg);
+		process_events (deadzone);
 	}
+	osc_flush ();
+
+	const double elapsed = (monotonic_nsec () - start) * 1e-9;
+	const Histogram *h = &replay_hist;
+	printf ("Replayed %lu events in %.3f sec: %.0f events/s\n", rx_events, elapsed, rx_events / elapsed);
+	printf ("OSC messages: %lu (%.0f/s) in %lu packets\n", tx_messages, tx_messages / elapsed, tx_packets);
+	if (h->count > 0) {
+		printf ("Processing time per event: avg %.0f ns, p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n",
+				h->sum / (double) h->count, hist_quantile (h, .5), hist_quantile (h, .99), hist_quantile (h, .999), h->max);
+	}
+	run = Terminate;
 }
 
 /******************************************************************************
@@ -769,19 +5648,41 @@ static void expand_and_send (Rule *r, MidiMessage *m) {
 static void wearedone (int sig) {
 	fprintf (stderr,"caught signal - shutting down.\n");
 	run = Terminate;
-	pthread_cond_signal (&data_ready);
-	signal (SIGHUP, SIG_DFL);
+	wakeup_signal (&main_wakeup);
 	signal (SIGINT, SIG_DFL);
 }
+
+static void reload (int sig) {
+	reload_request = 1;
+	wakeup_signal (&main_wakeup);
+}
+
+static void dump_stats (int sig) {
+	stats_request = 1;
+	wakeup_signal (&main_wakeup);
+}
 #endif
 
 static struct option const long_options[] =
 {
+	{"bundle", required_argument, 0, 'b'},
+	{"compile", no_argument, 0, 'C'},
 	{"config", required_argument, 0, 'c'},
+	{"liblo", no_argument, 0, 'F'},
 	{"help", no_argument, 0, 'h'},
 	{"input", required_argument, 0, 'i'},
+	{"journal", required_argument, 0, 'j'},
+	{"latency", no_argument, 0, 'L'},
+	{"listen", required_argument, 0, 'l'},
+	{"mtu", required_argument, 0, 'm'},
+	{"null", no_argument, 0, 'n'},
 	{"osc", required_argument, 0, 'o'},
+	{"overflow", required_argument, 0, 'O'},
+	{"queue", required_argument, 0, 'q'},
+	{"replay", required_argument, 0, 'r'},
+	{"realtime", no_argument, 0, 'R'},
 	{"syncmode", required_argument, 0, 's'},
+	{"ump", no_argument, 0, 'U'},
 	{"verbose", no_argument, 0, 'v'},
 	{"version", no_argument, 0, 'V'},
 	{NULL, 0, NULL, 0}
@@ -791,18 +5692,56 @@ static void usage (int status) {
 	printf ("jackmidi2osc - JACK MIDI to OSC.\n\n");
 	printf ("Usage: jackmidi2osc [ OPTIONS ]\n\n");
 	printf ("Options:\n\
+  -b <mode>, --bundle <mode>\n\
+                        combine OSC messages into bundles. Mode is one of\n\
+                        'Off', 'Cycle', 'Rule' (default: 'Off')\n\
   -c <file>, --config <file>\n\
                         specify configuration file\n\
+  -C, --compile         parse the configuration, write the rules to a\n\
+                        binary cache '<file>.cache' and exit\n\
+  -F, --liblo           send OSC packets with liblo instead of own sockets\n\
+                        (for comparing send paths with --replay)\n\
   -h, --help            display this help and exit\n\
   -i <port-name>, --input <port-name>\n\
-                        auto-connect to given jack-midi capture port\n\
+                        auto-connect the (first) input port to given\n\
+                        jack-midi capture port\n\
+  -j <file>, --journal <file>\n\
+                        record all received events to the given file,\n\
+                        which can be replayed with --replay. A previous\n\
+                        capture is kept as '<file>.N'\n\
+  -l <port>, --listen <port>\n\
+                        receive OSC for feedback rules on the given\n\
+                        UDP port or URL (e.g. 'osc.tcp://:9000')\n\
+  -L, --latency         measure latency from JACK process-callback to\n\
+                        dequeue and from dequeue to sending OSC,\n\
+                        print histograms on exit\n\
+  -m <bytes>, --mtu <bytes>\n\
+                        maximum size of an OSC bundle (default: 1400)\n\
+  -n, --null            discard OSC packets instead of sending them\n\
+                        (for benchmarking with --replay)\n\
   -o <addr>, --osc <addr>\n\
-                        set OSC destination address\n\
-                        as 'host:port' or simply port-number\n\
+                        set default OSC destination address\n\
+                        as 'host:port', simply port-number or an URL\n\
+                        osc.udp://, osc.tcp:// or osc.unix://\n\
                         (defaults to localhost:3819)\n\
+  -O <policy>, --overflow <policy>\n\
+                        events to drop if the queue is full. Policy is\n\
+                        one of 'Newest', 'Oldest', 'Coalesce'\n\
+                        (default: 'Newest')\n\
+  -q <size>, --queue <size>\n\
+                        capacity of the event queue, number of events or\n\
+                        duration in ms (e.g. '100ms') (default: 64)\n\
+  -r <file>, --replay <file>\n\
+                        process events from a Standard MIDI File or an\n\
+                        event log at full speed without JACK, and print\n\
+                        throughput and processing time per event\n\
+  -R, --realtime        replay events with their original timing\n\
   -s <mode>, --syncmode <mode>\n\
                         OSC event timing. Mode is one of 'Immediate',\n\
-                        'Absolute', 'Relative' (default: 'Immediate')\n\
+                        'Absolute', 'Relative', 'Timetag'\n\
+                        (default: 'Immediate')\n\
+  -U, --ump             receive MIDI 2.0 Universal MIDI Packets (requires\n\
+                        jack2 >= 1.9.23 or PipeWire)\n\
   -v, --verbose         increase verbosity (can be used twice)\n\
   -V, --version         print version information and exit\n\
 \n");
@@ -820,6 +5759,18 @@ See the example configuration file for further explanation.\n\
 Configuration Files:\n\
 By default jackmidi2osc reads $XDG_CONFIG_HOME/jackmidi2osc/default.cfg\n\
 on startup if the file exists.\n\
+The [config] section of all configuration files is read before any\n\
+rule, named destinations can be used by rules anywhere in the files.\n\
+Sending SIGHUP re-reads the rules from the configuration file(s) without\n\
+interrupting the event stream. Input ports, OSC destinations and the\n\
+[config] section are only read on startup.\n\
+Feedback rules in a [feedback] section translate incoming OSC messages\n\
+to MIDI, which is sent from the output port \"out\".\n\
+Sending SIGUSR1 writes runtime statistics as JSON to stdout, or to the\n\
+file given by the 'stats' configuration option.\n\
+If a rule cache written with --compile exists next to the configuration\n\
+file and matches its content, rules are loaded from the cache instead of\n\
+being parsed.\n\
 \n\
 Sync Modes:\n\
  'Immediate'   send events as soon as possible. Ignore event time.\n\
@@ -833,6 +5784,29 @@ Sync Modes:\n\
                with one cycle latency.\n\
                Compared to 'absolute' this mode has smaller jitter and\n\
                always retains the timing.\n\
+ 'Timetag'     send events immediately in OSC bundles, timestamped with\n\
+               the event time plus one cycle latency. The receiver\n\
+               schedules delivery. Requires synchronized wall-clocks\n\
+               if the receiver is on a different machine.\n\
+               Not available if sending falls back to liblo.\n\
+\n\
+Bundle Modes:\n\
+ 'Off'         send every OSC message as individual packet.\n\
+ 'Cycle'       combine all messages triggered by events of one JACK\n\
+               cycle into OSC bundle(s).\n\
+ 'Rule'        combine all messages of a single matching rule into\n\
+               OSC bundle(s).\n\
+               Bundles are split if they would exceed the MTU.\n\
+\n\
+Queue Overflow:\n\
+ Events are passed from the JACK process-callback to the OSC sender\n\
+ using a queue. If the queue cannot hold all events of a JACK cycle\n\
+ the overflow policy decides which events of that cycle to drop:\n\
+ 'Newest'      keep the first events, drop the remaining.\n\
+ 'Oldest'      keep the last events.\n\
+ 'Coalesce'    drop CC, pitch-bend and pressure events that are\n\
+               superseded by a later value in the same cycle first.\n\
+ A queue size given in ms allows for one event per audio sample.\n\
 \n");
 	printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
 	        "Website and manual: <https://github.com/x42/jackmidi2osc>\n"
@@ -844,34 +5818,99 @@ static int decode_switches (int argc, char **argv) {
 	int c;
 
 	while ((c = getopt_long (argc, argv,
+					"b:" /* bundle-mode */
 					"c:" /* configfile */
+					"C"  /* compile rule cache */
+					"F"  /* force liblo */
 					"h"  /* help */
 					"i:" /* MIDI port */
+					"j:" /* capture journal */
+					"L"  /* latency */
+					"l:" /* OSC feedback server */
+					"m:" /* mtu */
+					"n"  /* null sink */
 					"o:" /* osc dest */
+					"O:" /* overflow policy */
+					"q:" /* queue size */
+					"r:" /* replay file */
+					"R"  /* realtime replay */
 					"s:" /* sync-mode */
+					"U"  /* UMP input */
 					"v"  /* verbose */
 					"V", /* version */
 					long_options, (int *) 0)) != EOF) {
 		switch (c) {
+			case 'b':
+				if (parse_bundle_mode (optarg)) {
+					fprintf (stderr, "Invalid bundle mode option given\n");
+					usage (EXIT_FAILURE);
+				}
+				break;
 			case 'c':
 				free(cfgfile);
 				cfgfile = strdup (optarg);
 				break;
+			case 'C':
+				want_compile = 1;
+				break;
+			case 'F':
+				force_liblo = 1;
+				break;
 			case 'i':
 				free (j_connect);
 				j_connect = strdup (optarg);
 				break;
+			case 'j':
+				free (journal_file);
+				journal_file = strdup (optarg);
+				break;
+			case 'L':
+				want_latency = 1;
+				break;
+			case 'l':
+				free (listen_url);
+				listen_url = strdup (optarg);
+				break;
+			case 'm':
+				if (parse_mtu (optarg)) {
+					usage (EXIT_FAILURE);
+				}
+				break;
+			case 'n':
+				null_sink = 1;
+				break;
 			case 'o':
-				if (parse_osc_addr (optarg)) {
+				if (parse_osc_addr (NULL, optarg)) {
 					usage (EXIT_FAILURE);
 				}
 				break;
+			case 'O':
+				if (parse_overflow_policy (optarg)) {
+					fprintf (stderr, "Invalid overflow policy given\n");
+					usage (EXIT_FAILURE);
+				}
+				break;
+			case 'q':
+				if (parse_queue_size (optarg)) {
+					usage (EXIT_FAILURE);
+				}
+				break;
+			case 'r':
+				free (replay_file);
+				replay_file = strdup (optarg);
+				break;
+			case 'R':
+				replay_realtime = 1;
+				break;
 			case 's':
 				if (parse_sync_mode (optarg)) {
 					fprintf (stderr, "Invalid sync mode option given\n");
 					usage (EXIT_FAILURE);
 				}
 				break;
+			case 'U':
+				ump_input = 1;
+				break;
 			case 'v':
 				++want_verbose;
 				break;
@@ -896,6 +5935,12 @@ static int testfile (char *filename) {
 	return(0);
 }
 
+static void read_user_config (const char *filename) {
+	read_config (filename, NULL, ParseSettings);
+	free (usercfgfile);
+	usercfgfile = strdup (filename);
+}
+
 static void user_config_file (const char *fn) {
 	char filename[PATH_MAX];
 #ifdef _WIN32
@@ -903,31 +5948,32 @@ static void user_config_file (const char *fn) {
 	const char * homepath = getenv("HOMEPATH");
 	if (homedrive && homepath && (strlen(homedrive) + strlen(homepath) + strlen(fn) + 29) < PATH_MAX) {
 		sprintf(filename, "%s%s\\Local Settings\\jackmidi2osc\\%s", homedrive, homepath, fn);
-		if (testfile(filename)) read_config(filename);
+		if (testfile(filename)) read_user_config(filename);
 	}
 #else // unices - use XDG_CONFIG_HOME
 	const char *xdg = getenv("XDG_CONFIG_HOME");
 	const char *home = getenv("HOME");
 	if (xdg && (strlen(xdg) + strlen(fn) + 15) < PATH_MAX) {
 		sprintf(filename, "%s/jackmidi2osc/%s", xdg, fn);
-		if (testfile(filename)) read_config(filename);
+		if (testfile(filename)) read_user_config(filename);
 	}
 	// XDG_CONFIG_HOME fallback
 #ifdef __APPLE__
 	if (!xdg && home && (strlen(home) + strlen(fn) + 35) < PATH_MAX) {
 		sprintf(filename, "%s/Library/Preferences/jackmidi2osc/%s", home, fn);
-		if (testfile(filename)) read_config(filename);
+		if (testfile(filename)) read_user_config(filename);
 	}
 #else
 	if (!xdg && home && (strlen(home) + strlen(fn) + 23) < PATH_MAX) {
 		sprintf(filename, "%s/.config/jackmidi2osc/%s", home, fn);
-		if (testfile(filename)) read_config(filename);
+		if (testfile(filename)) read_user_config(filename);
 	}
 #endif
 #endif
 }
 
 int main (int argc, char ** argv) {
+	unsigned int i;
 
 	user_config_file ("default.cfg");
 
@@ -937,128 +5983,262 @@ int main (int argc, char ** argv) {
 		usage (EXIT_FAILURE);
 	}
 
-	if (cfgfile && read_config (cfgfile)) {
+	if (cfgfile && read_config (cfgfile, NULL, ParseSettings)) {
 		goto out;
 	}
 
-	if (rule_count == 0) {
-		fprintf (stderr, "No MIDI-> OSC Rules configured\n");
+	if (want_compile) {
+		if (!read_rules (&ruleset)) {
+			rule_cache_write (&ruleset);
+		}
+		goto out;
+	}
+
+	if (load_rules (&ruleset) || state_alloc (&ruleset)) {
+		goto out;
+	}
+
+	if (replay_file) {
+		if (replay_load (replay_file)) {
+			goto out;
+		}
+	} else {
+		if (init_jack ("jackmidi2osc")) {
+			goto out;
+		}
+
+		if (jack_portsetup ()) {
+			goto out;
+		}
+
+		if (feedback_start ()) {
+			goto out;
+		}
+	}
+
+	if (journal_file && journal_open ()) {
 		goto out;
 	}
 
-	if (init_jack ("jackmidi2osc")) {
+	if (dest_add (NULL) < 0) {
 		goto out;
 	}
 
-	if (jack_portsetup ()) {
+	if (!dests[0].addr) {
+		dests[0].addr = lo_address_new (NULL, "3819");
+	}
+
+	for (i = 0; i < dest_count; ++i) {
+		if (!dests[i].addr) {
+			fprintf (stderr, "No address for OSC destination '%s'.\n", dests[i].name);
+			goto out;
+		}
+		if (force_liblo) {
+			if (sync_mode == SyncTimetag) {
+				fprintf (stderr, "Timetag sync-mode is not available with liblo.\n");
+				goto out;
+			}
+			continue;
+		}
+		if (osc_open (&dests[i])) {
+			if (sync_mode == SyncTimetag) {
+				fprintf (stderr, "Cannot open OSC socket, Timetag sync-mode is not available with liblo.\n");
+				goto out;
+			}
+			fprintf (stderr, "Warning: Cannot open OSC socket, using liblo.\n");
+		}
+	}
+
+	if (osc_bundle_alloc ()) {
 		goto out;
 	}
 
-	if (!osc_dest) {
-		osc_dest = lo_address_new (NULL, "3819");
+	if (osc_sender_start ()) {
+		goto out;
 	}
 
 	if (want_verbose > 0) {
-		printf ("Parsed %d rules\n", rule_count);
-		char *url = lo_address_get_url(osc_dest);
-		printf ("Sending Messages to %s\n", url);
-		free(url);
+		printf ("Parsed %d rules, rule index: %d entries\n", ruleset.rule_count, ruleset.index_size);
+		for (i = 0; i < dest_count; ++i) {
+			char *url = lo_address_get_url(dests[i].addr);
+			printf ("Sending Messages to %s%s%s\n", url,
+					dests[i].name ? " as " : "", dests[i].name ? dests[i].name : "");
+			free(url);
+		}
+		if (fb_server) {
+			char *url = lo_server_thread_get_url (fb_server);
+			printf ("Receiving OSC feedback on %s, %d rules\n", url, feedback_count);
+			free(url);
+		}
 		if (want_verbose > 1) {
-			dump_cfg();
+			dump_cfg (&ruleset);
 		}
 	}
 
-	rb = jack_ringbuffer_create (RINGBUF_SIZE * sizeof (MidiMessage));
+	if (queue_ms > 0) {
+		queue_size = ceil (queue_ms * samplerate / 1000.0);
+	}
+
+	/* leave room for at least one SysEx message */
+	rb = jack_ringbuffer_create ((queue_size + 1) * sizeof (MidiMessage) + MAX_SYSEX_SIZE);
 
 	if (!rb) {
 		fprintf (stderr, "Cannot allocate rinbuffer..\n");
 		goto out;
 	}
 
-#ifndef _WIN32
-	if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
-		fprintf (stderr, "Warning: Cannot lock memory.\n");
+	/* actual capacity, the ringbuffer size is rounded up to a power of two */
+	queue_size = jack_ringbuffer_write_space (rb) / sizeof (MidiMessage);
+
+	if (sched_alloc (queue_size)) {
+		goto out;
 	}
-#endif
 
-	if (jack_activate (j_client)) {
-		fprintf (stderr, "cannot activate client.\n");
+	if (batch_alloc (2 * queue_size)) {
+		goto out;
+	}
+
+	if (sysex_alloc ()) {
+		goto out;
+	}
+
+	if (decoder_alloc ()) {
+		goto out;
+	}
+
+	/* also allocated without coalescing rules, those may be added by a reload */
+	if (!(batch_superseded = (uint8_t*) calloc (2 * queue_size, sizeof (uint8_t)))) {
+		goto out;
+	}
+
+	if (!(coalesce_seen = (uint8_t*) calloc (port_count, 256 * 128 / 8))) {
+		goto out;
+	}
+
+	if (overflow_policy == DropCoalesce
+			&& (!(overflow_seen = (uint8_t*) calloc (ump_input ? 16 : 1, 256 * 128 / 8))
+				|| !(overflow_superseded = (uint8_t*) calloc (port_count, COALESCE_EVENTS / 8)))) {
+		goto out;
+	}
+
+	coalesce_frames = ruleset.coalesce_rules > 0 ? ceil (coalesce_ms * samplerate / 1000.0) : 0;
+
+	if (want_latency && !(latency_pending = (uint32_t*) calloc (2 * queue_size, sizeof (uint32_t)))) {
+		goto out;
+	}
+
+	if (wakeup_init (&main_wakeup)) {
+		fprintf (stderr, "Cannot create wakeup notification.\n");
 		goto out;
 	}
 
-	if (inport_connect (j_connect)) {
+	if (!replay_file && jack_start ()) {
 		goto out;
 	}
 
 #ifndef _WIN32
-	signal (SIGHUP, wearedone);
+	signal (SIGHUP, reload);
+	signal (SIGUSR1, dump_stats);
 	signal (SIGINT, wearedone);
+	signal (SIGTERM, wearedone);
+	signal (SIGPIPE, SIG_IGN); // stream transports, handled by send()
 #endif
 
-	pthread_mutex_lock (&msg_thread_lock);
+	const jack_nframes_t deadzone = (sync_mode == SyncImmediate || sync_mode == SyncTimetag) ? 0 : ceil (0.0005 * samplerate); // .5ms
 
-	const jack_nframes_t deadzone = (sync_mode == SyncImmediate) ? 0 : ceil (0.0005 * samplerate); // .5ms
-	assert (deadzone >= 0);
+	stats_start = clock_usec ();
+	stats_next  = stats_start + stats_interval * (jack_time_t)1000000;
 
 	/* all systems go */
 	run = Running;
-	printf("Press Ctrl+C to terminate\n");
 
-	while (run != Terminate && j_client) {
-		int i,j;
-		const int mqlen = jack_ringbuffer_read_space (rb) / sizeof (MidiMessage);
-		for (i = 0; i < mqlen; ++i) {
-			MidiMessage mmsg;
-			jack_ringbuffer_read (rb, (char*) &mmsg, sizeof (MidiMessage));
+	if (replay_file) {
+		replay_run (deadzone);
+	} else {
+		printf("Press Ctrl+C to terminate\n");
+	}
 
-			if (want_verbose > 1) {
-				printf ("RX MIDI: [0x%02x 0x%02x 0x%02x] @%"PRIu32"\n",
-						(uint8_t)mmsg.d[0], (uint8_t)mmsg.d[1], (uint8_t)mmsg.d[2], mmsg.tme
-						);
-			}
+	while (run != Terminate && j_client) {
+		process_events (deadzone);
 
-			if (deadzone > 0) {
-				jack_nframes_t now = jack_frame_time (j_client);
-				//printf("NOW:                      @%"PRIu32"\n", now);
-				while (run != Terminate && j_client && now < mmsg.tme + deadzone) {
-					if ((mmsg.tme & 0x8000000) ^ (now & 0x8000000)) {
-						break; // handle 32bit roll-over
-					}
-					usleep((mmsg.tme + deadzone - now) * 1e6 / samplerate);
-					now = jack_frame_time (j_client);
-				}
-				if (run == Terminate) {
-					break;
-				}
+		if (stats_request || (stats_interval > 0 && (int64_t)(clock_usec () - stats_next) >= 0)) {
+			stats_request = 0;
+			stats_request_write ();
+			if (stats_interval > 0) {
+				stats_next = clock_usec () + stats_interval * (jack_time_t)1000000;
 			}
+		}
 
-			for (j = 0; j < rule_count; ++j) {
-				Rule *r = &rules[j];
-				if (    (r->len == 0 || r->len == mmsg.len)
-				     && (                (mmsg.d[0] & r->mask[0]) == r->match[0])
-				     && (mmsg.len < 2 || (mmsg.d[1] & r->mask[1]) == r->match[1])
-				     && (mmsg.len < 3 || (mmsg.d[2] & r->mask[2]) == r->match[2])
-				   )
-				{
-					if (want_verbose > 1) {
-						printf("       | Rule #%d -> %d osc msg(s)\n", j, r->message_count);
-					}
-					expand_and_send (r, &mmsg);
-				}
-			}
+#ifndef WIN32
+		if (reload_done && batch_len == 0) {
+			rules_reload_swap ();
 		}
+		if (reload_request && !reload_running) {
+			rules_reload_start ();
+		}
+#endif
 		fflush (stdout);
-		pthread_cond_wait (&data_ready, &msg_thread_lock);
+
+		if (batch_len > 0 && (sched_len == 0 || (int32_t)(batch_start + coalesce_frames - sched[0].m.tme) < 0)) {
+			wait_until (batch_start + coalesce_frames);
+		} else if (sched_len > 0) {
+			wait_until (sched[0].m.tme);
+		} else if (stats_interval > 0) {
+			const int64_t dt = stats_next - clock_usec ();
+			wakeup_wait (&main_wakeup, dt > 0 ? dt : 0);
+		} else {
+			wakeup_wait (&main_wakeup, -1);
+		}
 	}
 
-	pthread_mutex_unlock (&msg_thread_lock);
+	osc_sender_stop ();
+
+	if (want_latency) {
+		latency_report ("process-callback to dequeue", &latency_dequeue);
+		latency_report ("dequeue to send", &latency_send);
+	}
 
 	if (want_verbose > 0) {
-		printf ("\nDropped Messages: %d\n", dropped_messages);
+		unsigned long tx_alloc_sends = 0;
+		unsigned long tx_errors = 0;
+		printf ("\nDropped Messages: %d, coalesced: %d\n", STAT_GET (dropped_messages), STAT_GET (coalesced_messages));
+		if (sysex_dropped > 0) {
+			printf ("Dropped SysEx Messages: %lu (no free slot)\n", sysex_dropped);
+		}
+		if (STAT_GET (sysex_oversize) > 0) {
+			printf ("Ignored SysEx Messages: %lu (longer than %d bytes)\n", STAT_GET (sysex_oversize), MAX_SYSEX_SIZE);
+		}
+		printf ("Queue size: %u events, high-water mark: %u, overflow in %lu cycles (max %u events)\n",
+				queue_size, STAT_GET (queue_hwm), STAT_GET (overflow_cycles), STAT_GET (overflow_max));
+		if (deadzone > 0) {
+			printf ("Late Messages: %lu (max %.1f ms)\n", late_events, late_max * 1000.0 / samplerate);
+		}
+		for (i = 0; i < dest_count; ++i) {
+			const OSCDest *d = &dests[i];
+			tx_alloc_sends += d->alloc_sends;
+			tx_errors += d->errors;
+			printf ("OSC destination '%s': queue high-water mark %u bytes, dropped %lu packets, max queued %.1f ms, max send %.1f ms\n",
+					d->name ? d->name : "default", d->txq_hwm, d->txq_dropped, d->wait_max / 1000.0, d->stall_max / 1000.0);
+			printf ("OSC destination '%s': %lu packets in %lu syscalls (%.2f packets/syscall)\n",
+					d->name ? d->name : "default", d->sent, d->syscalls, d->syscalls > 0 ? d->sent / (double) d->syscalls : 0);
+			if (d->reconnects > 0) {
+				printf ("OSC destination '%s': %lu reconnects\n", d->name ? d->name : "default", d->reconnects);
+			}
+			if (d->untimed > 0) {
+				printf ("OSC destination '%s': %lu messages sent without timetag\n", d->name ? d->name : "default", d->untimed);
+			}
+		}
+		printf ("OSC Messages sent: %lu in %lu packets (%lu with heap allocation), errors: %lu\n",
+				tx_messages, tx_packets, tx_alloc_sends, tx_errors);
+		if (journal) {
+			printf ("Journal: %lu bytes recorded, %lu events not recorded (journal full)\n",
+					(unsigned long) journal_pos, journal_dropped);
+		}
 	}
 
 out:
 
+	journal_close ();
 	cleanup ();
 	return 0;
 }